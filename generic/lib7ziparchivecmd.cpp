@@ -1,6 +1,21 @@
+#include <stdlib.h>
 #include <string.h>
+#include <vector>
+#include <set>
+#include <map>
+#include <sys/stat.h>
+#ifdef _WIN32
+#   include <sys/utime.h>
+#else
+#   include <utime.h>
+#endif
 #include "lib7ziparchivecmd.hpp"
+#include "lib7zipcmd.hpp"
 #include "lib7zipstream.hpp"
+#include "lib7zipsignature.hpp"
+#include "lib7ziplibrary.hpp"
+#include "lib7zipchannel.hpp"
+#include "lib7zipgrep.hpp"
 
 #if defined(LIB7ZIPARCHIVECMD_DEBUG)
 #   include <iostream>
@@ -13,6 +28,24 @@
 
 #define LIST_MATCH_NOCASE TCL_MATCH_NOCASE
 #define LIST_MATCH_EXACT (1 << 16)
+#define LIST_INDICES (1 << 17)
+
+#define PRESERVE_MTIME (1 << 0)
+#define PRESERVE_MODE (1 << 1)
+
+#define UPDATE_NONE 0
+#define UPDATE_MTIME 1
+#define UPDATE_CHECKSUM 2
+
+#define DEDUPE_NONE 0
+#define DEDUPE_CLONE 1
+#define DEDUPE_VERIFY 2
+
+// NOTE: handle open decodes the compressed items into memory, up to this size by default
+#define OPEN_MEMORY_MAX (64 * 1024 * 1024)
+
+typedef std::map<std::string, std::pair<UInt64, UInt64> > Lib7ZipManifest;
+typedef std::map<std::pair<UInt64, UInt64>, std::pair<Tcl_Obj *, std::string> > Lib7ZipWritten;
 
 // NOTE: should match lib7zip::PropertyIndexEnum
 static const char *const Lib7ZipProperties[] = {
@@ -41,22 +74,59 @@ static const char *const Lib7ZipProperties[] = {
     0L
 };
 
+typedef struct {
+    unsigned int index;
+    std::string path;
+    bool done;
+    bool ok;
+    UInt64 bytes;
+} Lib7ZipTestTask;
+
+typedef struct {
+    Lib7ZipLibrary *library;
+    std::wstring file;
+    std::wstring ext;
+    std::wstring password;
+    std::vector<Lib7ZipTestTask> *tasks;
+    Lib7ZipCancel *cancel;
+    size_t first;
+    size_t step;
+    Tcl_ThreadId id;
+    bool started;
+} Lib7ZipTestWorker;
+
+static void Lib7ZipTestItems(C7ZipArchive *archive, std::vector<Lib7ZipTestTask> &tasks,
+    size_t first, size_t step, const std::wstring *password, Lib7ZipCancel *cancel);
+#ifdef TCL_THREADS
+static Tcl_ThreadCreateType Lib7ZipTestThread(ClientData clientData);
+#endif
+static int Lib7ZipCreateDirectory(Tcl_Interp *interp, Tcl_Obj *path);
+static void Lib7ZipRemovePartial(Tcl_Obj *file);
+static int Lib7ZipReadManifest(Tcl_Interp *interp, Tcl_Obj *file, Lib7ZipManifest &manifest);
+static int Lib7ZipWriteManifest(Tcl_Interp *interp, Tcl_Obj *file, const Lib7ZipManifest &manifest);
 static int Tcl_StringCaseEqual(const char *str1, const char *str2, int nocase);
+static bool Path_IsSafe(const std::string &path);
+static int Attrib_ToMode(UInt64 attrib);
 static Int64 Time_FileTimeToUnixTime64(UInt64 filetime);
-#ifdef _WIN32
-static std::string Path_WindowsPathToUnixPath(std::string path);
-#endif
 
 Lib7ZipArchiveCmd::Lib7ZipArchiveCmd (Tcl_Interp *interp, const char *name, TclCmd *parent,
-        C7ZipArchive *archive, Lib7ZipInStream *stream):
-        TclCmd(interp, name, parent), archive(archive), stream(stream), volumes(NULL), convert() {
+        C7ZipArchive *archive, C7ZipInStream *stream, const std::wstring &password):
+        TclCmd(interp, name, parent), archive(archive), stream(stream), volumes(NULL), password(password), stored(NULL), busy(false), handle(name), cancel(), convert() {
     DEBUGLOG("Lib7ZipArchiveCmd, archive " << archive << ", stream " << stream);
+    Lib7ZipInStream *file = dynamic_cast<Lib7ZipInStream *>(stream);
+    if (file)
+        file->SetCancel(&cancel);
+    Lib7ZipReaderInStream *reader = dynamic_cast<Lib7ZipReaderInStream *>(stream);
+    if (reader)
+        reader->SetCancel(&cancel);
+    Lib7ZipLibrary::RegisterCancel(handle, &cancel);
 };
 
 Lib7ZipArchiveCmd::Lib7ZipArchiveCmd (Tcl_Interp *interp, const char *name, TclCmd *parent,
-        C7ZipArchive *archive, Lib7ZipMultiVolumes *volumes):
-        TclCmd(interp, name, parent), archive(archive), stream(NULL), volumes(volumes), convert() {
+        C7ZipArchive *archive, Lib7ZipMultiVolumes *volumes, const std::wstring &password):
+        TclCmd(interp, name, parent), archive(archive), stream(NULL), volumes(volumes), password(password), stored(NULL), busy(false), handle(name), cancel(), convert() {
     DEBUGLOG("Lib7ZipArchiveCmd, archive " << archive << ", volumes " << volumes);
+    Lib7ZipLibrary::RegisterCancel(handle, &cancel);
 };
 
 Lib7ZipArchiveCmd::~Lib7ZipArchiveCmd () {
@@ -79,9 +149,18 @@ Lib7ZipArchiveCmd::~Lib7ZipArchiveCmd () {
         delete stream;
     if (volumes)
         delete volumes;
+    if (stored)
+        delete stored;
+    ClearPassword(password);
+    Lib7ZipLibrary::UnregisterCancel(handle);
 }
 
 void Lib7ZipArchiveCmd::Cleanup() {
+    // NOTE: deleted while busy, stop the operation, the archive goes on free
+    if (busy) {
+        cancel.Cancel();
+        return;
+    }
 #ifdef DESTROY_ARCHIVE_BUG
     DEBUGLOG("Lib7ZipArchiveCmd::Cleanup, close/delete archive " << archive);
     if (archive) {
@@ -90,14 +169,23 @@ void Lib7ZipArchiveCmd::Cleanup() {
         archive = NULL;
     }
 #endif    
+    ClearPassword(password);
 };
 
+void Lib7ZipArchiveCmd::ClearPassword(std::wstring &password) {
+    // NOTE: volatile access keeps the compiler from dropping the wipe
+    volatile wchar_t *p = password.empty() ? NULL : &password[0];
+    for (size_t i = 0; i < password.size(); i++)
+        p[i] = 0;
+    password.clear();
+}
+
 int Lib7ZipArchiveCmd::Command (int objc, Tcl_Obj *const objv[]) {
     static const char *const commands[] = {
-        "info", "count", "list", "extract", "close", 0L
+        "info", "count", "list", "extract", "extractall", "test", "open", "read", "grep", "cancel", "close", 0L
     };
     enum commands {
-        cmInfo, cmCount, cmList, cmExtract, cmClose
+        cmInfo, cmCount, cmList, cmExtract, cmExtractAll, cmTest, cmOpen, cmRead, cmGrep, cmCancel, cmClose
     };
     int index;
 
@@ -108,6 +196,11 @@ int Lib7ZipArchiveCmd::Command (int objc, Tcl_Obj *const objv[]) {
     if (Tcl_GetIndexFromObj(tclInterp, objv[1], commands, "subcommand", 0, &index) != TCL_OK) {
         return TCL_ERROR;
     }
+    // NOTE: an extraction waiting for a slow channel serves the event loop
+    if (busy && index != cmCancel) {
+        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj("archive is busy", -1));
+        return TCL_ERROR;
+    }
 
     switch ((enum commands)(index)) {
 
@@ -143,15 +236,16 @@ int Lib7ZipArchiveCmd::Command (int objc, Tcl_Obj *const objv[]) {
 
         if (objc >= 2) {
             static const char * const options[] = {
-                "-info", "-nocase", "-exact", "-type", "--", 0L
+                "-info", "-indices", "-peek", "-nocase", "-exact", "-type", "--", 0L
             };
             enum options {
-                opInfo, opNocase, opExact, opType, opEnd
+                opInfo, opIndices, opPeek, opNocase, opExact, opType, opEnd
             };
             int index;
             int flags = 0;
             char type = 'a';
             bool info = false;
+            Tcl_WideInt peek = -1;
             Tcl_Obj *patternObj = NULL;
             for (int i = 2; i < objc; i++) {
                 if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
@@ -165,6 +259,17 @@ int Lib7ZipArchiveCmd::Command (int objc, Tcl_Obj *const objv[]) {
                 case opInfo:
                     info = true;
                     continue;
+                case opIndices:
+                    flags |= LIST_INDICES;
+                    continue;
+                case opPeek:
+                    if (i < objc - 1 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &peek) == TCL_OK && peek >= 0) {
+                        i++;
+                        continue;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-peek\" option must be followed by size", -1));
+                    return TCL_ERROR;
                 case opNocase:
                     flags |= LIST_MATCH_NOCASE;
                     continue;
@@ -192,8 +297,11 @@ int Lib7ZipArchiveCmd::Command (int objc, Tcl_Obj *const objv[]) {
                 };
                 break;
             };
-            if (List(Tcl_GetObjResult(tclInterp), patternObj, type, flags, info) != TCL_OK)
+            cancel.Start(0);
+            if (List(Tcl_GetObjResult(tclInterp), patternObj, type, flags, info, peek) != TCL_OK) {
+                cancel.SetError(tclInterp);
                 return TCL_ERROR;
+            }
         } else {
             Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? ?pattern?");
             return TCL_ERROR;
@@ -203,13 +311,27 @@ int Lib7ZipArchiveCmd::Command (int objc, Tcl_Obj *const objv[]) {
     case cmExtract:
         if (objc >= 4) {
             static const char * const options[] = {
-                "-password", "-channel", 0L
+                "-password", "-channel", "-hash", "-highwater", "-timeout", "-sparse", "-index", "-restore", 0L
             };
             enum options {
-                opPassword, opChannel
+                opPassword, opChannel, opHash, opHighwater, opTimeout, opSparse, opIndex, opRestore
+            };
+            // NOTE: should match Lib7ZipHash algorithm bits
+            static const char * const hashes[] = {
+                "crc32", "sha256", "xxh3", 0L
+            };
+            // NOTE: should match PRESERVE_* bits
+            static const char * const attributes[] = {
+                "mtime", "mode", 0L
             };
             int index;
+            int preserve = 0;
             bool usechannel = false;
+            bool sparse = false;
+            bool byindex = false;
+            int hash = 0;
+            Tcl_WideInt highwater = 0;
+            Tcl_WideInt timeout = 0;
             Tcl_Obj *password = NULL;
             for (int i = 2; i < objc - 2; i++) {
                 if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
@@ -228,177 +350,1296 @@ int Lib7ZipArchiveCmd::Command (int objc, Tcl_Obj *const objv[]) {
                 case opChannel:
                     usechannel = true;
                     break;
+                case opHash:
+                    if (i < objc - 3) {
+                        Tcl_Size hashc;
+                        Tcl_Obj **hashv;
+                        if (Tcl_ListObjGetElements(tclInterp, objv[++i], &hashc, &hashv) != TCL_OK)
+                            return TCL_ERROR;
+                        for (Tcl_Size h = 0; h < hashc; h++) {
+                            if (Tcl_GetIndexFromObj(tclInterp, hashv[h], hashes, "hash", 0, &index) != TCL_OK)
+                                return TCL_ERROR;
+                            hash |= 1 << index;
+                        }
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-hash\" option must be followed by list of hashes", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opHighwater:
+                    if (i < objc - 3) {
+                        if (Tcl_GetWideIntFromObj(tclInterp, objv[++i], &highwater) != TCL_OK)
+                            return TCL_ERROR;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-highwater\" option must be followed by size", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opTimeout:
+                    if (TimeoutOption(i < objc - 3 ? objv[++i] : NULL, &timeout) != TCL_OK)
+                        return TCL_ERROR;
+                    break;
+                case opSparse:
+                    sparse = true;
+                    break;
+                case opIndex:
+                    byindex = true;
+                    break;
+                case opRestore:
+                    if (i < objc - 3) {
+                        Tcl_Size attrc;
+                        Tcl_Obj **attrv;
+                        if (Tcl_ListObjGetElements(tclInterp, objv[++i], &attrc, &attrv) != TCL_OK)
+                            return TCL_ERROR;
+                        for (Tcl_Size a = 0; a < attrc; a++) {
+                            if (Tcl_GetIndexFromObj(tclInterp, attrv[a], attributes, "attribute", 0, &index) != TCL_OK)
+                                return TCL_ERROR;
+                            preserve |= 1 << index;
+                        }
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-restore\" option must be followed by list of attributes", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
                 }
             }
-            if (Extract(objv[objc-2], objv[objc-1], password, usechannel) != TCL_OK)
+            if (preserve && usechannel) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "\"-restore\" option can not be used with \"-channel\"", -1));
+                return TCL_ERROR;
+            }
+            if (sparse && usechannel) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "\"-sparse\" option can not be used with \"-channel\"", -1));
+                return TCL_ERROR;
+            }
+            if (highwater != 0 && (!usechannel || highwater < 0)) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "\"-highwater\" option must be positive and requires \"-channel\"", -1));
+                return TCL_ERROR;
+            }
+            cancel.Start(timeout);
+            if (Extract(objv[objc-2], byindex, objv[objc-1], password, usechannel, hash, highwater, sparse,
+                    preserve) != TCL_OK) {
+                cancel.SetError(tclInterp);
                 return TCL_ERROR;
+            }
         } else {
             Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? item path");
             return TCL_ERROR;
         }
         break;
 
-    case cmClose:
-        if (objc > 2) {
-            Tcl_WrongNumArgs(tclInterp, 2, objv, NULL);
-            return TCL_ERROR;
-        } else {
-            Cleanup();
-            delete this;
-        }
-        break;
-    }
-
-    return TCL_OK;
-};
-
-int Lib7ZipArchiveCmd::Info(Tcl_Obj *info) {
-    for (int prop = lib7zip::PROP_INDEX_BEGIN; prop < lib7zip::PROP_INDEX_END; prop++) {
-        UInt64 intval;
-        if (archive->GetUInt64Property((lib7zip::PropertyIndexEnum)prop, intval)) {
-            Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj(Lib7ZipProperties[prop], -1));
-            Tcl_ListObjAppendElement(NULL, info, Tcl_NewWideIntObj(intval));
-            continue;
-        }
-        bool boolval;
-        if (archive->GetBoolProperty((lib7zip::PropertyIndexEnum)prop, boolval)) {
-            Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj(Lib7ZipProperties[prop], -1));
-            Tcl_ListObjAppendElement(NULL, info, Tcl_NewBooleanObj(boolval));
-            continue;
-        }
-        std::wstring wstrval;
-        if (archive->GetStringProperty((lib7zip::PropertyIndexEnum)prop, wstrval)) {
-            Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj(Lib7ZipProperties[prop], -1));
-            Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj(convert.to_bytes(wstrval).c_str(), -1));
-            continue;
-        }
-        UInt64 timeval;
-        if (archive->GetFileTimeProperty((lib7zip::PropertyIndexEnum)prop, timeval)) {
-            Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj(Lib7ZipProperties[prop], -1));
-            Tcl_ListObjAppendElement(NULL, info, Tcl_NewWideIntObj(Time_FileTimeToUnixTime64(timeval)));
-            continue;
-        }
-        DEBUGLOG("Lib7ZipArchiveCmd unhandled prop " << Lib7ZipProperties[prop]);
-    }
-    return TCL_OK;
-}
-
-int Lib7ZipArchiveCmd::List(Tcl_Obj *list, Tcl_Obj *pattern, char type, int flags, bool info) {
-    unsigned int count;
-    if (!archive->GetItemCount(&count)) // NOTE: always OK
-        return TCL_ERROR;
-
-    for (unsigned int i = 0; i < count; ++i) {
-        C7ZipArchiveItem *item;
-        if (!archive->GetItemInfo(i, &item)) // NOTE: always OK
-            return TCL_ERROR;
-
-        if (type == 'd' && !item->IsDir())
-            continue;
-        if (type == 'f' && item->IsDir())
-            continue;
-
-#ifdef _WIN32
-        std::string path = Path_WindowsPathToUnixPath(convert.to_bytes(item->GetFullPath()).c_str());
-#else
-        std::string path = convert.to_bytes(item->GetFullPath()).c_str();
-#endif
-        if (pattern) {
-            if (flags & LIST_MATCH_EXACT) {
-                if (!Tcl_StringCaseEqual(path.c_str(), Tcl_GetString(pattern), flags & TCL_MATCH_NOCASE))
-                    continue;
-            } else { 
-                if (!Tcl_StringCaseMatch(path.c_str(), Tcl_GetString(pattern), flags & TCL_MATCH_NOCASE))
-                    continue;
-            }
-        }
-        if (info) {
-            Tcl_Obj *propObj = Tcl_NewObj();
-            for (int prop = lib7zip::PROP_INDEX_BEGIN; prop < lib7zip::PROP_INDEX_END; prop++) {
-                UInt64 intval;
-                if (item->GetUInt64Property((lib7zip::PropertyIndexEnum)prop, intval)) {
-                    Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewStringObj(Lib7ZipProperties[prop], -1));
-                    Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewWideIntObj(intval));
-                    continue;
+    case cmExtractAll:
+        if (objc >= 2) {
+            static const char * const options[] = {
+                "-password", "-todir", "-restore", "-timeout", "-dedupe", "-verify", "-update", "-manifest",
+                "-preserve", "--", 0L
+            };
+            // NOTE: -preserve is the former name of -restore, kept as an alias
+            enum options {
+                opPassword, opTodir, opRestore, opTimeout, opDedupe, opVerify, opUpdate, opManifest,
+                opPreserve, opEnd
+            };
+            // NOTE: should match PRESERVE_* bits
+            static const char * const attributes[] = {
+                "mtime", "mode", 0L
+            };
+            // NOTE: should match UPDATE_* values
+            static const char * const updates[] = {
+                "none", "mtime", "checksum", 0L
+            };
+            int index;
+            int preserve = 0;
+            int update = UPDATE_NONE;
+            bool dedupe = false;
+            bool verify = false;
+            Tcl_Obj *manifest = NULL;
+            Tcl_WideInt timeout = 0;
+            Tcl_Obj *password = NULL;
+            Tcl_Obj *todir = NULL;
+            Tcl_Obj *patternObj = NULL;
+            for (int i = 2; i < objc; i++) {
+                if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
+                    if (i < objc - 1)
+                        return TCL_ERROR;
+                    Tcl_ResetResult(tclInterp);
+                    patternObj = objv[i];
+                    break;
                 }
-                bool boolval;
-                if (item->GetBoolProperty((lib7zip::PropertyIndexEnum)prop, boolval)) {
-                    Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewStringObj(Lib7ZipProperties[prop], -1));
-                    Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewBooleanObj(boolval));
+                switch ((enum options)(index)) {
+                case opPassword:
+                    if (i < objc - 1) {
+                        password = objv[++i];
+                        continue;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-password\" option must be followed by password", -1));
+                    return TCL_ERROR;
+                case opTodir:
+                    if (i < objc - 1) {
+                        todir = objv[++i];
+                        continue;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-todir\" option must be followed by directory", -1));
+                    return TCL_ERROR;
+                case opRestore:
+                case opPreserve:
+                    if (i < objc - 1) {
+                        Tcl_Size attrc;
+                        Tcl_Obj **attrv;
+                        if (Tcl_ListObjGetElements(tclInterp, objv[++i], &attrc, &attrv) != TCL_OK)
+                            return TCL_ERROR;
+                        for (Tcl_Size a = 0; a < attrc; a++) {
+                            if (Tcl_GetIndexFromObj(tclInterp, attrv[a], attributes, "attribute", 0, &index) != TCL_OK)
+                                return TCL_ERROR;
+                            preserve |= 1 << index;
+                        }
+                        continue;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                            "\"%s\" option must be followed by list of attributes", options[index]));
+                    return TCL_ERROR;
+                case opTimeout:
+                    if (TimeoutOption(i < objc - 1 ? objv[++i] : NULL, &timeout) != TCL_OK)
+                        return TCL_ERROR;
                     continue;
-                }
-                std::wstring wstrval;
-                if (item->GetStringProperty((lib7zip::PropertyIndexEnum)prop, wstrval)) {
-                    std::string strval = convert.to_bytes(wstrval);
-#ifdef _WIN32
-                    if (prop == lib7zip::kpidPath)
-                        strval = Path_WindowsPathToUnixPath(strval);
-#endif
-                    Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewStringObj(Lib7ZipProperties[prop], -1));
-                    Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewStringObj(strval.c_str(), -1));
+                case opDedupe:
+                    dedupe = true;
                     continue;
-                }
-                UInt64 timeval;
-                if (item->GetFileTimeProperty((lib7zip::PropertyIndexEnum)prop, timeval)) {
-                    Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewStringObj(Lib7ZipProperties[prop], -1));
-                    Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewWideIntObj(Time_FileTimeToUnixTime64(timeval)));
+                case opVerify:
+                    verify = true;
                     continue;
-                }
-                DEBUGLOG("Lib7ZipArchiveCmd unhandled item prop " << Lib7ZipProperties[prop]);
+                case opUpdate:
+                    if (i < objc - 1) {
+                        if (Tcl_GetIndexFromObj(tclInterp, objv[++i], updates, "update mode", 0, &update) != TCL_OK)
+                            return TCL_ERROR;
+                        continue;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-update\" option must be followed by mode", -1));
+                    return TCL_ERROR;
+                case opManifest:
+                    if (i < objc - 1) {
+                        manifest = objv[++i];
+                        continue;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-manifest\" option must be followed by file name", -1));
+                    return TCL_ERROR;
+                case opEnd:
+                    if (i == objc - 2)
+                        patternObj = objv[i+1];
+                    if (i >= objc - 2)
+                        break;
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"--\" option can be followed by pattern only", -1));
+                    return TCL_ERROR;
+                };
+                break;
+            };
+            if (!todir) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                        "\"-todir\" option must be specified", -1));
+                return TCL_ERROR;
+            }
+            if ((update == UPDATE_CHECKSUM) != (manifest != NULL)) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                        "\"-manifest\" option must be used with \"-update checksum\"", -1));
+                return TCL_ERROR;
+            }
+            if (verify && !dedupe) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                        "\"-verify\" option must be used with \"-dedupe\"", -1));
+                return TCL_ERROR;
+            }
+            // NOTE: the next update compares with the item times, so they must be kept
+            if (update == UPDATE_MTIME)
+                preserve |= PRESERVE_MTIME;
+            if (!Valid())
+                return TCL_ERROR;
+            cancel.Start(timeout);
+            if (ExtractAll(Tcl_GetObjResult(tclInterp), todir, patternObj, password, preserve,
+                    dedupe ? (verify ? DEDUPE_VERIFY : DEDUPE_CLONE) : DEDUPE_NONE, update, manifest) != TCL_OK) {
+                cancel.SetError(tclInterp);
+                return TCL_ERROR;
             }
-            Tcl_ListObjAppendElement(NULL, list, propObj);
         } else {
-            Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj(path.c_str(), -1));
-        }
-    }
-    return TCL_OK;
-}
-
-int Lib7ZipArchiveCmd::Extract(Tcl_Obj *source, Tcl_Obj *destination, Tcl_Obj *password, bool usechannel) {
-    int result = TCL_OK;
-    unsigned int count;
-    if (!archive->GetItemCount(&count)) // NOTE: always OK
-        return TCL_ERROR;
-    unsigned int i;
-    for (i = 0; i < count; ++i) {
-        C7ZipArchiveItem *item;
-        if (!archive->GetItemInfo(i, &item)) // NOTE: always OK
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? ?pattern?");
             return TCL_ERROR;
+        }
+        break;
 
-        if (item->IsDir())
-            continue;
-
-#ifdef _WIN32
-        std::string path = Path_WindowsPathToUnixPath(convert.to_bytes(item->GetFullPath()).c_str());
-#else
-        std::string path = convert.to_bytes(item->GetFullPath()).c_str();
-#endif
-        if (strcmp(path.c_str(), Tcl_GetString(source)) == 0) {
-            Lib7ZipOutStream *out = new Lib7ZipOutStream(tclInterp, destination, usechannel);
-            if (!out->Valid())
-                result = TCL_ERROR;
-            else
-                if (password) {  
-                    if (!archive->Extract(i, out, convert.from_bytes(Tcl_GetString(password))))
-                        result = TCL_ERROR;
-                } else {
-                    if (!archive->Extract(i, out))
-                        result = TCL_ERROR;
+    case cmTest:
+        if (objc >= 2) {
+            static const char * const options[] = {
+                "-password", "-workers", "-timeout", "--", 0L
+            };
+            enum options {
+                opPassword, opWorkers, opTimeout, opEnd
+            };
+            int index;
+            int workers = 1;
+            Tcl_WideInt timeout = 0;
+            Tcl_Obj *password = NULL;
+            Tcl_Obj *patternObj = NULL;
+            for (int i = 2; i < objc; i++) {
+                if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
+                    if (i < objc - 1)
+                        return TCL_ERROR;
+                    Tcl_ResetResult(tclInterp);
+                    patternObj = objv[i];
+                    break;
                 }
-            delete out;
-            // TODO: restore attrs ???
-            // item->GetUInt64Property(lib7zip::kpidAttrib, &attr);
-            // item->GetUInt64Property(lib7zip::kpidMTime, &mtime);
-            break;
+                switch ((enum options)(index)) {
+                case opPassword:
+                    if (i < objc - 1) {
+                        password = objv[++i];
+                        continue;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-password\" option must be followed by password", -1));
+                    return TCL_ERROR;
+                case opWorkers:
+                    if (i < objc - 1 && Tcl_GetIntFromObj(NULL, objv[i+1], &workers) == TCL_OK && workers > 0) {
+                        i++;
+                        continue;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-workers\" option must be followed by positive integer", -1));
+                    return TCL_ERROR;
+                case opTimeout:
+                    if (TimeoutOption(i < objc - 1 ? objv[++i] : NULL, &timeout) != TCL_OK)
+                        return TCL_ERROR;
+                    continue;
+                case opEnd:
+                    if (i == objc - 2)
+                        patternObj = objv[i+1];
+                    if (i >= objc - 2)
+                        break;
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"--\" option can be followed by pattern only", -1));
+                    return TCL_ERROR;
+                };
+                break;
+            };
+            if (!Valid())
+                return TCL_ERROR;
+            cancel.Start(timeout);
+            if (Test(Tcl_GetObjResult(tclInterp), patternObj, password, workers) != TCL_OK)
+                return TCL_ERROR;
+            // NOTE: the items aborted are reported as failed otherwise
+            if (cancel.SetError(tclInterp))
+                return TCL_ERROR;
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? ?pattern?");
+            return TCL_ERROR;
         }
-    }
-    if (i >= count) {
-        Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("no such item \"%s\" in the archive", Tcl_GetString(source)));
+        break;
+
+    case cmOpen:
+        if (objc >= 3) {
+            static const char * const options[] = {
+                "-password", "-seekable", "-index", "-maxmemory", 0L
+            };
+            enum options {
+                opPassword, opSeekable, opIndex, opMaxMemory
+            };
+            int index;
+            bool seekable = false;
+            bool byindex = false;
+            Tcl_WideInt maxmemory = OPEN_MEMORY_MAX;
+            Tcl_Obj *password = NULL;
+            for (int i = 2; i < objc - 1; i++) {
+                if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                switch ((enum options)(index)) {
+                case opPassword:
+                    if (i < objc - 2) {
+                        password = objv[++i];
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-password\" option must be followed by password", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opSeekable:
+                    seekable = true;
+                    break;
+                case opIndex:
+                    byindex = true;
+                    break;
+                case opMaxMemory:
+                    if (i < objc - 2 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &maxmemory) == TCL_OK && maxmemory >= 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-maxmemory\" option must be followed by size", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                }
+            }
+            if (!Valid())
+                return TCL_ERROR;
+            cancel.Start(0);
+            if (Open(objv[objc-1], byindex, password, seekable, maxmemory) != TCL_OK) {
+                cancel.SetError(tclInterp);
+                return TCL_ERROR;
+            }
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? item");
+            return TCL_ERROR;
+        }
+        break;
+
+    case cmRead:
+        if (objc >= 3) {
+            static const char * const options[] = {
+                "-password", "-index", "-limit", "-timeout", 0L
+            };
+            enum options {
+                opPassword, opIndex, opLimit, opTimeout
+            };
+            int index;
+            bool byindex = false;
+            Tcl_WideInt limit = -1;
+            Tcl_WideInt timeout = 0;
+            Tcl_Obj *password = NULL;
+            for (int i = 2; i < objc - 1; i++) {
+                if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                switch ((enum options)(index)) {
+                case opPassword:
+                    if (i < objc - 2) {
+                        password = objv[++i];
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-password\" option must be followed by password", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opIndex:
+                    byindex = true;
+                    break;
+                case opLimit:
+                    if (i < objc - 2 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &limit) == TCL_OK && limit >= 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-limit\" option must be followed by size", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opTimeout:
+                    if (TimeoutOption(i < objc - 2 ? objv[++i] : NULL, &timeout) != TCL_OK)
+                        return TCL_ERROR;
+                    break;
+                }
+            }
+            if (!Valid())
+                return TCL_ERROR;
+            cancel.Start(timeout);
+            if (Read(objv[objc-1], byindex, password, limit) != TCL_OK) {
+                cancel.SetError(tclInterp);
+                return TCL_ERROR;
+            }
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? item");
+            return TCL_ERROR;
+        }
+        break;
+
+    case cmGrep:
+        if (objc >= 3) {
+            static const char * const options[] = {
+                "-nocase", "-regexp", "-list", "-password", "-timeout", "--", 0L
+            };
+            enum options {
+                opNocase, opRegexp, opList, opPassword, opTimeout, opEnd
+            };
+            int index;
+            int flags = 0;
+            Tcl_WideInt timeout = 0;
+            Tcl_Obj *password = NULL;
+            int i;
+            for (i = 2; i < objc; i++) {
+                if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
+                    if (i < objc - 2)
+                        return TCL_ERROR;
+                    Tcl_ResetResult(tclInterp);
+                    break;
+                }
+                switch ((enum options)(index)) {
+                case opNocase:
+                    flags |= Lib7ZipGrepOutStream::GREP_NOCASE;
+                    continue;
+                case opRegexp:
+                    flags |= Lib7ZipGrepOutStream::GREP_REGEXP;
+                    continue;
+                case opList:
+                    flags |= Lib7ZipGrepOutStream::GREP_FIRST;
+                    continue;
+                case opPassword:
+                    if (i < objc - 1) {
+                        password = objv[++i];
+                        continue;
+                    }
+                    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-password\" option must be followed by password", -1));
+                    return TCL_ERROR;
+                case opTimeout:
+                    if (TimeoutOption(i < objc - 1 ? objv[++i] : NULL, &timeout) != TCL_OK)
+                        return TCL_ERROR;
+                    continue;
+                case opEnd:
+                    i++;
+                    break;
+                };
+                break;
+            };
+            if (i != objc - 1 && i != objc - 2) {
+                Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? pattern ?itemPattern?");
+                return TCL_ERROR;
+            }
+            if (!Valid())
+                return TCL_ERROR;
+            cancel.Start(timeout);
+            if (Grep(Tcl_GetObjResult(tclInterp), objv[i], i < objc - 1 ? objv[i+1] : NULL, flags, password) != TCL_OK) {
+                cancel.SetError(tclInterp);
+                return TCL_ERROR;
+            }
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? pattern ?itemPattern?");
+            return TCL_ERROR;
+        }
+        break;
+
+    case cmCancel:
+        if (objc > 2) {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, NULL);
+            return TCL_ERROR;
+        } else {
+            cancel.Cancel();
+        }
+        break;
+
+    case cmClose:
+        if (objc > 2) {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, NULL);
+            return TCL_ERROR;
+        } else {
+            Tcl_DeleteCommandFromToken(tclInterp, tclToken);
+        }
+        break;
+    }
+
+    return TCL_OK;
+};
+
+int Lib7ZipArchiveCmd::Info(Tcl_Obj *info) {
+    for (int prop = lib7zip::PROP_INDEX_BEGIN; prop < lib7zip::PROP_INDEX_END; prop++) {
+        UInt64 intval;
+        if (archive->GetUInt64Property((lib7zip::PropertyIndexEnum)prop, intval)) {
+            Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj(Lib7ZipProperties[prop], -1));
+            Tcl_ListObjAppendElement(NULL, info, Tcl_NewWideIntObj(intval));
+            continue;
+        }
+        bool boolval;
+        if (archive->GetBoolProperty((lib7zip::PropertyIndexEnum)prop, boolval)) {
+            Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj(Lib7ZipProperties[prop], -1));
+            Tcl_ListObjAppendElement(NULL, info, Tcl_NewBooleanObj(boolval));
+            continue;
+        }
+        std::wstring wstrval;
+        if (archive->GetStringProperty((lib7zip::PropertyIndexEnum)prop, wstrval)) {
+            Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj(Lib7ZipProperties[prop], -1));
+            Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj(convert.to_bytes(wstrval).c_str(), -1));
+            continue;
+        }
+        UInt64 timeval;
+        if (archive->GetFileTimeProperty((lib7zip::PropertyIndexEnum)prop, timeval)) {
+            Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj(Lib7ZipProperties[prop], -1));
+            Tcl_ListObjAppendElement(NULL, info, Tcl_NewWideIntObj(Time_FileTimeToUnixTime64(timeval)));
+            continue;
+        }
+        DEBUGLOG("Lib7ZipArchiveCmd unhandled prop " << Lib7ZipProperties[prop]);
+    }
+    return TCL_OK;
+}
+
+int Lib7ZipArchiveCmd::List(Tcl_Obj *list, Tcl_Obj *pattern, char type, int flags, bool info, Tcl_WideInt peek) {
+    unsigned int count;
+    if (!archive->GetItemCount(&count)) // NOTE: always OK
+        return TCL_ERROR;
+    std::wstring pwd;
+    if (peek >= 0)
+        pwd = ItemPassword(NULL);
+
+    for (unsigned int i = 0; i < count; ++i) {
+        C7ZipArchiveItem *item;
+        if (!archive->GetItemInfo(i, &item)) // NOTE: always OK
+            return TCL_ERROR;
+
+        if (type == 'd' && !item->IsDir())
+            continue;
+        if (type == 'f' && item->IsDir())
+            continue;
+
+        std::string path = ItemPath(item);
+        if (pattern) {
+            if (flags & LIST_MATCH_EXACT) {
+                if (!Tcl_StringCaseEqual(path.c_str(), Tcl_GetString(pattern), flags & TCL_MATCH_NOCASE))
+                    continue;
+            } else { 
+                if (!Tcl_StringCaseMatch(path.c_str(), Tcl_GetString(pattern), flags & TCL_MATCH_NOCASE))
+                    continue;
+            }
+        }
+        Tcl_Obj *peekObj = NULL;
+        if (peek >= 0) {
+            // NOTE: the decoder of each item is stopped after the first bytes
+            if (item->IsDir()) {
+                peekObj = Tcl_NewByteArrayObj(NULL, 0);
+            } else {
+                Lib7ZipDataOutStream out((UInt64)peek);
+                out.SetCancel(&cancel);
+                busy = true;
+                bool ok = ExtractItem(i, &out, pwd) || out.Truncated();
+                busy = false;
+                if (!ok) {
+                    ClearPassword(pwd);
+                    Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("error extracting item \"%s\"", path.c_str()));
+                    return TCL_ERROR;
+                }
+                peekObj = out.GetData();
+            }
+        }
+        if (info) {
+            Lib7ZipItemProperties props;
+            Lib7ZipGetItemProperties(item, convert, props);
+            Tcl_Obj *propObj = Lib7ZipNewItemPropertiesObj(props);
+            if (flags & LIST_INDICES) {
+                Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewStringObj("index", -1));
+                Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewWideIntObj(i));
+            }
+            if (peekObj) {
+                Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewStringObj("peek", -1));
+                Tcl_ListObjAppendElement(NULL, propObj, peekObj);
+            }
+            Tcl_ListObjAppendElement(NULL, list, propObj);
+        } else {
+            if (flags & LIST_INDICES)
+                Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(i));
+            else
+                Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj(path.c_str(), -1));
+            if (peekObj)
+                Tcl_ListObjAppendElement(NULL, list, peekObj);
+        }
+    }
+    ClearPassword(pwd);
+    return TCL_OK;
+}
+
+int Lib7ZipArchiveCmd::Extract(Tcl_Obj *source, bool byindex, Tcl_Obj *destination, Tcl_Obj *password,
+        bool usechannel, int hashes, Tcl_WideInt highwater, bool sparse, int preserve) {
+    int result = TCL_OK;
+    unsigned int index;
+    if (!ItemIndex(source, byindex, &index))
+        return TCL_ERROR;
+    Lib7ZipOutStream *out = new Lib7ZipOutStream(tclInterp, destination, usechannel);
+    Lib7ZipHash *hash = hashes ? new Lib7ZipHash(hashes) : NULL;
+    out->SetHash(hash);
+    out->SetHighWater(highwater);
+    out->SetSparse(sparse);
+    out->SetCancel(&cancel);
+    bool created = !usechannel && out->Valid();
+    if (!out->Valid()) {
         result = TCL_ERROR;
+    } else {
+        std::wstring pwd = ItemPassword(password);
+        busy = true;
+        if (!ExtractFile(index, out, pwd))
+            result = TCL_ERROR;
+        busy = false;
+        ClearPassword(pwd);
+        if (result == TCL_OK && out->Finish() != 0)
+            result = WriteError(destination);
+        C7ZipArchiveItem *item;
+        if (result == TCL_OK && preserve && archive->GetItemInfo(index, &item))
+            RestoreMetadata(item, out, preserve);
+        if (result == TCL_OK && out->Close() != 0)
+            result = WriteError(destination);
+    }
+    delete out;
+    if (result != TCL_OK && created)
+        Lib7ZipRemovePartial(destination);
+    if (hash) {
+        if (result == TCL_OK) {
+            Tcl_Obj *digests = Tcl_NewObj();
+            if (hashes & Lib7ZipHash::HASH_CRC32) {
+                Tcl_ListObjAppendElement(NULL, digests, Tcl_NewStringObj("crc32", -1));
+                Tcl_ListObjAppendElement(NULL, digests, Tcl_NewStringObj(hash->Crc32().c_str(), -1));
+            }
+            if (hashes & Lib7ZipHash::HASH_SHA256) {
+                Tcl_ListObjAppendElement(NULL, digests, Tcl_NewStringObj("sha256", -1));
+                Tcl_ListObjAppendElement(NULL, digests, Tcl_NewStringObj(hash->Sha256().c_str(), -1));
+            }
+            if (hashes & Lib7ZipHash::HASH_XXH3) {
+                Tcl_ListObjAppendElement(NULL, digests, Tcl_NewStringObj("xxh3", -1));
+                Tcl_ListObjAppendElement(NULL, digests, Tcl_NewStringObj(hash->Xxh3().c_str(), -1));
+            }
+            Tcl_SetObjResult(tclInterp, digests);
+        }
+        delete hash;
     }
     return result;
 }
 
+int Lib7ZipArchiveCmd::Read(Tcl_Obj *source, bool byindex, Tcl_Obj *password, Tcl_WideInt limit) {
+    unsigned int index;
+    if (!ItemIndex(source, byindex, &index))
+        return TCL_ERROR;
+    // NOTE: the stream fails on purpose at the limit, that stops decoding the rest of the item
+    Lib7ZipDataOutStream *out = limit >= 0 ? new Lib7ZipDataOutStream((UInt64)limit) : new Lib7ZipDataOutStream();
+    out->SetCancel(&cancel);
+    std::wstring pwd = ItemPassword(password);
+    busy = true;
+    bool ok = ExtractItem(index, out, pwd) || out->Truncated();
+    busy = false;
+    ClearPassword(pwd);
+    if (ok)
+        Tcl_SetObjResult(tclInterp, out->GetData());
+    else
+        Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("error extracting item \"%s\"", Tcl_GetString(source)));
+    delete out;
+    return ok ? TCL_OK : TCL_ERROR;
+}
+
+int Lib7ZipArchiveCmd::Open(Tcl_Obj *source, bool byindex, Tcl_Obj *password, bool seekable,
+        Tcl_WideInt maxmemory) {
+    unsigned int index;
+    C7ZipArchiveItem *item;
+    if (!ItemIndex(source, byindex, &index) || !archive->GetItemInfo(index, &item))
+        return TCL_ERROR;
+    Tcl_Channel channel = NULL;
+    const Lib7ZipStoredItem *located = StoredItem(item);
+    if (located) {
+        // NOTE: the stored data is read from the archive file, the seeks don't decode anything
+        Lib7ZipInStream *file = dynamic_cast<Lib7ZipInStream *>(stream);
+        Tcl_Obj *fileObj = Tcl_NewStringObj(convert.to_bytes(file->GetName()).c_str(), -1);
+        Tcl_IncrRefCount(fileObj);
+        channel = Lib7ZipChannel::OpenRange(tclInterp, fileObj, file->Base() + located->offset, located->size);
+        Tcl_DecrRefCount(fileObj);
+    } else if (seekable) {
+        Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+            "item \"%s\" can not be read without decoding", Tcl_GetString(source)));
+        return TCL_ERROR;
+    } else if (item->GetSize() > (UInt64)maxmemory) {
+        Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+            "item \"%s\" is larger than %" TCL_LL_MODIFIER "d bytes to decode in memory",
+            Tcl_GetString(source), (Tcl_WideInt)maxmemory));
+        return TCL_ERROR;
+    } else {
+        // NOTE: the size property may be missing or wrong, the stream stops at the bound anyway
+        Lib7ZipDataOutStream *out = new Lib7ZipDataOutStream((UInt64)maxmemory);
+        out->SetCancel(&cancel);
+        std::wstring pwd = ItemPassword(password);
+        busy = true;
+        bool ok = ExtractItem(index, out, pwd);
+        busy = false;
+        ClearPassword(pwd);
+        if (ok)
+            channel = Lib7ZipChannel::OpenData(tclInterp, out->GetData());
+        else if (out->Truncated())
+            Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                "item \"%s\" is larger than %" TCL_LL_MODIFIER "d bytes to decode in memory",
+                Tcl_GetString(source), (Tcl_WideInt)maxmemory));
+        else
+            Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("error extracting item \"%s\"", Tcl_GetString(source)));
+        delete out;
+    }
+    if (!channel)
+        return TCL_ERROR;
+    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(Tcl_GetChannelName(channel), -1));
+    return TCL_OK;
+}
+
+int Lib7ZipArchiveCmd::Grep(Tcl_Obj *result, Tcl_Obj *pattern, Tcl_Obj *itemPattern, int flags, Tcl_Obj *password) {
+    Lib7ZipGrepOutStream out(tclInterp, pattern, flags);
+    if (!out.Valid())
+        return TCL_ERROR;
+    out.SetCancel(&cancel);
+    unsigned int count;
+    if (!archive->GetItemCount(&count)) // NOTE: always OK
+        return TCL_ERROR;
+    std::wstring pwd = ItemPassword(password);
+    int code = TCL_OK;
+    busy = true;
+    for (unsigned int i = 0; i < count && code == TCL_OK; ++i) {
+        C7ZipArchiveItem *item;
+        if (!archive->GetItemInfo(i, &item)) // NOTE: always OK
+            continue;
+        if (item->IsDir())
+            continue;
+        std::string path = ItemPath(item);
+        if (itemPattern && !Tcl_StringMatch(path.c_str(), Tcl_GetString(itemPattern)))
+            continue;
+        Tcl_Obj *itemObj = Tcl_NewStringObj(path.c_str(), -1);
+        Tcl_IncrRefCount(itemObj);
+        out.Start(itemObj, result);
+        // NOTE: the stream fails on purpose to stop decoding after the first match
+        if (!ExtractItem(i, &out, pwd) && !out.Stopped()) {
+            if (!out.Failed())
+                Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("error extracting item \"%s\"", path.c_str()));
+            code = TCL_ERROR;
+        } else if (out.Finish() != 0) {
+            code = TCL_ERROR;
+        } else if ((flags & Lib7ZipGrepOutStream::GREP_FIRST) && out.Found()) {
+            Tcl_ListObjAppendElement(NULL, result, itemObj);
+        }
+        Tcl_DecrRefCount(itemObj);
+    }
+    busy = false;
+    ClearPassword(pwd);
+    return code;
+}
+
+int Lib7ZipArchiveCmd::ExtractAll(Tcl_Obj *result, Tcl_Obj *todir, Tcl_Obj *pattern, Tcl_Obj *password, int preserve,
+        int dedupe, int update, Tcl_Obj *manifestFile) {
+    std::vector<unsigned int> files;
+    std::vector<unsigned int> dirs;
+    std::set<std::string> folders;
+    unsigned int count;
+    if (!archive->GetItemCount(&count)) // NOTE: always OK
+        return TCL_ERROR;
+    for (unsigned int i = 0; i < count; ++i) {
+        C7ZipArchiveItem *item;
+        if (!archive->GetItemInfo(i, &item)) // NOTE: always OK
+            return TCL_ERROR;
+        std::string path = ItemPath(item);
+        if (pattern && !Tcl_StringMatch(path.c_str(), Tcl_GetString(pattern)))
+            continue;
+        if (!Path_IsSafe(path)) {
+            Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("unsafe item path \"%s\"", path.c_str()));
+            return TCL_ERROR;
+        }
+        std::string folder = path;
+        if (!item->IsDir()) {
+            size_t sep = path.find_last_of('/');
+            folder = sep == std::string::npos ? "" : path.substr(0, sep);
+        }
+        while (!folder.empty() && folders.insert(folder).second) {
+            size_t sep = folder.find_last_of('/');
+            folder = sep == std::string::npos ? "" : folder.substr(0, sep);
+        }
+        if (item->IsDir())
+            dirs.push_back(i);
+        else
+            files.push_back(i);
+    }
+
+    // NOTE: with dedupe the items of the same size and checksum are decoded once,
+    // the later ones are cloned from the first file, with verify only when their SHA-256 matches too
+    Lib7ZipChecksums checksums;
+    Lib7ZipWritten written;
+    if (dedupe || update == UPDATE_CHECKSUM)
+        LocateChecksums(checksums);
+    // NOTE: the manifest keeps the size and checksum of the items written by the previous updates
+    Lib7ZipManifest manifest;
+    if (manifestFile && Lib7ZipReadManifest(tclInterp, manifestFile, manifest) != TCL_OK)
+        return TCL_ERROR;
+    // NOTE: without the item checksums every item would be decoded again, the 7z and tar have none
+    if (update == UPDATE_CHECKSUM && !files.empty()) {
+        bool any = false;
+        for (size_t f = 0; f < files.size() && !any; f++) {
+            C7ZipArchiveItem *item;
+            UInt64 checksum;
+            any = archive->GetItemInfo(files[f], &item) && ItemChecksum(item, checksums, &checksum);
+        }
+        if (!any) {
+            Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                "archive has no item checksums, use \"-update mtime\"", -1));
+            return TCL_ERROR;
+        }
+    }
+
+    // create the whole tree first, parent folders are sorted before children
+    if (Lib7ZipCreateDirectory(tclInterp, todir) != TCL_OK)
+        return TCL_ERROR;
+    for (std::set<std::string>::iterator f = folders.begin(); f != folders.end(); f++) {
+        Tcl_Obj *relative = Tcl_NewStringObj(f->c_str(), -1);
+        Tcl_IncrRefCount(relative);
+        Tcl_Obj *folderObj = Tcl_FSJoinToPath(todir, 1, &relative);
+        Tcl_IncrRefCount(folderObj);
+        int code = Lib7ZipCreateDirectory(tclInterp, folderObj);
+        Tcl_DecrRefCount(folderObj);
+        Tcl_DecrRefCount(relative);
+        if (code != TCL_OK)
+            return TCL_ERROR;
+    }
+
+    std::wstring pwd = ItemPassword(password);
+    int code = TCL_OK;
+    for (size_t f = 0; f < files.size() && code == TCL_OK; f++) {
+        C7ZipArchiveItem *item;
+        if (!archive->GetItemInfo(files[f], &item)) // NOTE: always OK
+            continue;
+        std::string path = ItemPath(item);
+        Tcl_Obj *relative = Tcl_NewStringObj(path.c_str(), -1);
+        Tcl_IncrRefCount(relative);
+        Tcl_Obj *fileObj = Tcl_FSJoinToPath(todir, 1, &relative);
+        Tcl_IncrRefCount(fileObj);
+        std::pair<UInt64, UInt64> key(item->GetSize(), 0);
+        bool known = (dedupe || manifestFile) && ItemChecksum(item, checksums, &key.second);
+        if (update != UPDATE_NONE && Unchanged(item, fileObj, update, known ? &key : NULL, manifest)) {
+            // the file on disk is still a valid clone source
+            if (dedupe && known && key.first > 0 && written.find(key) == written.end()) {
+                Tcl_IncrRefCount(fileObj);
+                written[key] = std::make_pair(fileObj, std::string());
+            }
+            Tcl_DecrRefCount(fileObj);
+            Tcl_DecrRefCount(relative);
+            continue;
+        }
+        if (manifestFile)
+            manifest.erase(path);
+        known = known && dedupe && key.first > 0;
+        Lib7ZipWritten::iterator first = known ? written.find(key) : written.end();
+        Lib7ZipOutStream *out = new Lib7ZipOutStream(tclInterp, fileObj, false);
+        out->SetCancel(&cancel);
+        int cloned = 1;
+        if (first != written.end() && out->Valid() &&
+                (dedupe != DEDUPE_VERIFY || SameContent(files[f], pwd, first->second)))
+            cloned = out->CloneFile(first->second.first);
+        if (cloned < 0) {
+            // NOTE: a failed copy may leave a partial file, it is written again by the decoder
+            delete out;
+            out = new Lib7ZipOutStream(tclInterp, fileObj, false);
+            out->SetCancel(&cancel);
+        }
+        bool created = out->Valid();
+        if (!created) {
+            code = TCL_ERROR;
+        } else if (cloned != 0 && !ExtractFile(files[f], out, pwd)) {
+            Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("error extracting item \"%s\"", path.c_str()));
+            code = TCL_ERROR;
+        } else if (out->Finish() != 0) {
+            code = WriteError(fileObj);
+        } else {
+            RestoreMetadata(item, out, preserve);
+            if (out->Close() != 0)
+                code = WriteError(fileObj);
+        }
+        if (code == TCL_OK) {
+            if (known && first == written.end()) {
+                Tcl_IncrRefCount(fileObj);
+                written[key] = std::make_pair(fileObj, std::string());
+            }
+            UInt64 checksum;
+            if (manifestFile && ItemChecksum(item, checksums, &checksum))
+                manifest[path] = std::make_pair(item->GetSize(), checksum);
+        }
+        delete out;
+        if (code != TCL_OK && created)
+            Lib7ZipRemovePartial(fileObj);
+        Tcl_DecrRefCount(fileObj);
+        Tcl_DecrRefCount(relative);
+        if (code == TCL_OK)
+            Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj(path.c_str(), -1));
+    }
+    ClearPassword(pwd);
+    DEBUGLOG("Lib7ZipArchiveCmd::ExtractAll " << files.size() << " files, " << written.size() << " decoded for dedupe");
+    for (Lib7ZipWritten::iterator w = written.begin(); w != written.end(); ++w)
+        Tcl_DecrRefCount(w->second.first);
+    // NOTE: written after a failure too, the items done so far are not decoded again
+    if (manifestFile) {
+        Tcl_Obj *error = code != TCL_OK ? Tcl_GetObjResult(tclInterp) : NULL;
+        if (error)
+            Tcl_IncrRefCount(error);
+        if (Lib7ZipWriteManifest(tclInterp, manifestFile, manifest) != TCL_OK)
+            code = TCL_ERROR;
+        if (error) {
+            Tcl_SetObjResult(tclInterp, error);
+            Tcl_DecrRefCount(error);
+        }
+    }
+    if (code != TCL_OK)
+        return TCL_ERROR;
+
+    // folder times are restored after their content is written
+    if (preserve & PRESERVE_MTIME) {
+        for (size_t d = 0; d < dirs.size(); d++) {
+            C7ZipArchiveItem *item;
+            UInt64 filetime;
+            if (!archive->GetItemInfo(dirs[d], &item) || !item->GetFileTimeProperty(lib7zip::kpidMTime, filetime))
+                continue;
+            Tcl_Obj *relative = Tcl_NewStringObj(ItemPath(item).c_str(), -1);
+            Tcl_IncrRefCount(relative);
+            Tcl_Obj *folderObj = Tcl_FSJoinToPath(todir, 1, &relative);
+            Tcl_IncrRefCount(folderObj);
+            struct utimbuf times;
+            times.actime = times.modtime = (time_t)Time_FileTimeToUnixTime64(filetime);
+            Tcl_FSUtime(folderObj, &times);
+            Tcl_DecrRefCount(folderObj);
+            Tcl_DecrRefCount(relative);
+        }
+    }
+    return TCL_OK;
+}
+
+int Lib7ZipArchiveCmd::WriteError(Tcl_Obj *file) {
+    Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("error writing file \"%s\": %s",
+        Tcl_GetString(file), Tcl_ErrnoMsg(Tcl_GetErrno())));
+    return TCL_ERROR;
+}
+
+void Lib7ZipArchiveCmd::RestoreMetadata(C7ZipArchiveItem *item, Lib7ZipOutStream *out, int preserve) {
+    UInt64 attrib;
+    if ((preserve & PRESERVE_MODE) && item->GetUInt64Property(lib7zip::kpidAttrib, attrib)) {
+        // NOTE: a zero mode from a unix attribute would lock the owner out of the file
+        int mode = Attrib_ToMode(attrib);
+        if (mode > 0)
+            out->SetMode(mode);
+    }
+    UInt64 filetime;
+    if ((preserve & PRESERVE_MTIME) && item->GetFileTimeProperty(lib7zip::kpidMTime, filetime))
+        out->SetMTime(filetime);
+}
+
+int Lib7ZipArchiveCmd::Test(Tcl_Obj *result, Tcl_Obj *pattern, Tcl_Obj *password, int workers) {
+    std::vector<Lib7ZipTestTask> tasks;
+    unsigned int count;
+    if (!archive->GetItemCount(&count)) // NOTE: always OK
+        return TCL_ERROR;
+    for (unsigned int i = 0; i < count; ++i) {
+        C7ZipArchiveItem *item;
+        if (!archive->GetItemInfo(i, &item)) // NOTE: always OK
+            return TCL_ERROR;
+        if (item->IsDir())
+            continue;
+        Lib7ZipTestTask task;
+        task.index = i;
+        task.path = ItemPath(item);
+        task.done = false;
+        task.ok = false;
+        task.bytes = 0;
+        if (pattern && !Tcl_StringMatch(task.path.c_str(), Tcl_GetString(pattern)))
+            continue;
+        tasks.push_back(task);
+    }
+
+    std::wstring pwd = ItemPassword(password);
+
+    Tcl_Time start, stop;
+    Tcl_GetTime(&start);
+
+    // NOTE: every worker opens its own archive instance, that is possible for
+    // archive files only and makes sense for non-solid archives only
+    std::vector<Lib7ZipTestWorker> threads;
+#ifdef TCL_THREADS
+    Lib7ZipInStream *file = dynamic_cast<Lib7ZipInStream *>(stream);
+    bool solid = false;
+    if (!file || file->IsChannel() || file->IsRanged() ||
+            (archive->GetBoolProperty(lib7zip::kpidSolid, solid) && solid))
+        workers = 1;
+    if ((size_t)workers > tasks.size())
+        workers = tasks.size() > 0 ? (int)tasks.size() : 1;
+    if (workers > 1) {
+        threads.resize(workers - 1);
+        for (int w = 1; w < workers; w++) {
+            Lib7ZipTestWorker &worker = threads[w-1];
+            worker.library = ((Lib7ZipCmd *)pParent)->Library();
+            worker.file = file->GetName();
+            worker.ext = file->GetExt();
+            worker.password = pwd;
+            worker.tasks = &tasks;
+            worker.cancel = &cancel;
+            worker.first = w;
+            worker.step = workers;
+            worker.started = Tcl_CreateThread(&worker.id, Lib7ZipTestThread, &worker,
+                TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) == TCL_OK;
+        }
+    }
+#else
+    workers = 1;
+#endif
+    Lib7ZipTestItems(archive, tasks, 0, workers, pwd.empty() ? NULL : &pwd, &cancel);
+#ifdef TCL_THREADS
+    for (size_t w = 0; w < threads.size(); w++) {
+        int state;
+        if (threads[w].started)
+            Tcl_JoinThread(threads[w].id, &state);
+    }
+#endif
+    // items left by workers failed to start or to open the archive
+    Lib7ZipTestItems(archive, tasks, 0, 1, pwd.empty() ? NULL : &pwd, &cancel);
+    for (size_t w = 0; w < threads.size(); w++)
+        ClearPassword(threads[w].password);
+    ClearPassword(pwd);
+
+    Tcl_GetTime(&stop);
+
+    Tcl_WideInt failed = 0;
+    Tcl_WideInt bytes = 0;
+    Tcl_Obj *itemsObj = Tcl_NewObj();
+    for (size_t i = 0; i < tasks.size(); i++) {
+        if (!tasks[i].ok)
+            failed++;
+        bytes += tasks[i].bytes;
+        Tcl_ListObjAppendElement(NULL, itemsObj, Tcl_NewStringObj(tasks[i].path.c_str(), -1));
+        Tcl_ListObjAppendElement(NULL, itemsObj, Tcl_NewStringObj(tasks[i].ok ? "ok" : "error", -1));
+    }
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("tested", -1));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewWideIntObj(tasks.size()));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("failed", -1));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewWideIntObj(failed));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("bytes", -1));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewWideIntObj(bytes));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("usec", -1));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewWideIntObj(
+        ((Tcl_WideInt)stop.sec - start.sec) * 1000000 + (stop.usec - start.usec)));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("workers", -1));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewIntObj(workers));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("items", -1));
+    Tcl_ListObjAppendElement(NULL, result, itemsObj);
+    return TCL_OK;
+}
+
+// NOTE: no interpreter involved, the catalog workers read the properties in their threads
+
+void Lib7ZipGetItemProperties(C7ZipArchiveItem *item, std::wstring_convert<std::codecvt_utf8<wchar_t>> &convert,
+        Lib7ZipItemProperties &props) {
+    for (int prop = lib7zip::PROP_INDEX_BEGIN; prop < lib7zip::PROP_INDEX_END; prop++) {
+        Lib7ZipItemProperty p = {prop, PROPERTY_NUMBER, 0, std::string()};
+        bool boolval;
+        std::wstring wstrval;
+        if (item->GetUInt64Property((lib7zip::PropertyIndexEnum)prop, p.number)) {
+            p.type = PROPERTY_NUMBER;
+        } else if (item->GetBoolProperty((lib7zip::PropertyIndexEnum)prop, boolval)) {
+            p.type = PROPERTY_BOOL;
+            p.number = boolval;
+        } else if (item->GetStringProperty((lib7zip::PropertyIndexEnum)prop, wstrval)) {
+            p.type = PROPERTY_STRING;
+            p.text = convert.to_bytes(wstrval);
+#ifdef _WIN32
+            if (prop == lib7zip::kpidPath)
+                p.text = Path_WindowsPathToUnixPath(p.text);
+#endif
+        } else if (item->GetFileTimeProperty((lib7zip::PropertyIndexEnum)prop, p.number)) {
+            p.type = PROPERTY_TIME;
+        } else {
+            DEBUGLOG("Lib7ZipGetItemProperties unhandled item prop " << Lib7ZipProperties[prop]);
+            continue;
+        }
+        props.push_back(p);
+    }
+}
+
+Tcl_Obj *Lib7ZipNewItemPropertiesObj(const Lib7ZipItemProperties &props) {
+    Tcl_Obj *propObj = Tcl_NewObj();
+    for (size_t i = 0; i < props.size(); i++) {
+        const Lib7ZipItemProperty &p = props[i];
+        Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewStringObj(Lib7ZipProperties[p.prop], -1));
+        switch (p.type) {
+        case PROPERTY_NUMBER:
+            Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewWideIntObj(p.number));
+            break;
+        case PROPERTY_BOOL:
+            Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewBooleanObj(p.number != 0));
+            break;
+        case PROPERTY_STRING:
+            Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewStringObj(p.text.c_str(), -1));
+            break;
+        case PROPERTY_TIME:
+            Tcl_ListObjAppendElement(NULL, propObj, Tcl_NewWideIntObj(Time_FileTimeToUnixTime64(p.number)));
+            break;
+        }
+    }
+    return propObj;
+}
+
+std::wstring Lib7ZipArchiveCmd::ItemPassword(Tcl_Obj *passwordObj) {
+    // the -password option overrides the handle default set by "open -password"
+    return passwordObj ? convert.from_bytes(Tcl_GetString(passwordObj)) : password;
+}
+
+bool Lib7ZipArchiveCmd::ExtractItem(unsigned int index, C7ZipOutStream *out, const std::wstring &pwd) {
+    return pwd.empty() ? archive->Extract(index, out) : archive->Extract(index, out, pwd);
+}
+
+bool Lib7ZipArchiveCmd::ExtractFile(unsigned int index, Lib7ZipOutStream *out, const std::wstring &pwd) {
+    C7ZipArchiveItem *item;
+    if (out->IsNative() && archive->GetItemInfo(index, &item)) {
+        int copied = CopyStored(item, out);
+        if (copied == 0)
+            return true;
+        if (copied < 0)
+            return false;
+        // NOTE: best effort, the decoder writes the same bytes anyway
+        if (item->GetSize() > 0)
+            out->SetSize(item->GetSize());
+    }
+    return ExtractItem(index, out, pwd);
+}
+
+// Checks an item against a file written before by their SHA-256, the digest
+// of the file is computed once and kept with it.
+
+bool Lib7ZipArchiveCmd::SameContent(unsigned int index, const std::wstring &pwd,
+        std::pair<Tcl_Obj *, std::string> &source) {
+    if (source.second.empty()) {
+        Tcl_Channel chan = Tcl_FSOpenFileChannel(NULL, source.first, "rb", 0);
+        if (chan == NULL)
+            return false;
+        Lib7ZipHash hash(Lib7ZipHash::HASH_SHA256);
+        char buffer[65536];
+        Tcl_Size got;
+        while ((got = Tcl_Read(chan, buffer, sizeof(buffer))) > 0)
+            hash.Update(buffer, (size_t)got);
+        bool eof = got == 0 && Tcl_Eof(chan);
+        Tcl_Close(NULL, chan);
+        if (!eof)
+            return false;
+        source.second = hash.Sha256();
+    }
+    Lib7ZipHash hash(Lib7ZipHash::HASH_SHA256);
+    Lib7ZipNullOutStream out;
+    out.SetHash(&hash);
+    out.SetCancel(&cancel);
+    return ExtractItem(index, &out, pwd) && hash.Sha256() == source.second;
+}
+
+int Lib7ZipArchiveCmd::CopyStored(C7ZipArchiveItem *item, Lib7ZipOutStream *out) {
+    const Lib7ZipStoredItem *located = StoredItem(item);
+    if (!located)
+        return 1;
+    Lib7ZipInStream *file = dynamic_cast<Lib7ZipInStream *>(stream);
+    return out->CopyRange(file->NativeHandle(), file->Base() + located->offset, located->size);
+}
+
+const Lib7ZipStoredItem *Lib7ZipArchiveCmd::StoredItem(C7ZipArchiveItem *item) {
+    // NOTE: only plain archive files opened by name, the channel position is not ours
+    Lib7ZipInStream *file = dynamic_cast<Lib7ZipInStream *>(stream);
+    if (!file || file->IsChannel() || item->IsDir() || item->IsEncrypted())
+        return NULL;
+    if (!stored) {
+        UInt64 pos;
+        if (file->Seek(0, SEEK_CUR, &pos) != 0)
+            return NULL;
+        stored = new Lib7ZipStoredItems();
+        std::vector<std::string> types;
+        if (Lib7ZipIdentify(file, types) && !types.empty())
+            Lib7ZipLocateStored(file, types[0], *stored);
+        file->Seek((__int64)pos, SEEK_SET, NULL);
+    }
+    Lib7ZipStoredItems::iterator it = stored->find(ItemPath(item));
+    if (it == stored->end() || it->second.size != item->GetSize())
+        return NULL;
+    return &it->second;
+}
+
+// Tells whether the destination file still holds the item, by one stat of the file
+// and the item time, or the size and checksum recorded in the manifest.
+
+bool Lib7ZipArchiveCmd::Unchanged(C7ZipArchiveItem *item, Tcl_Obj *fileObj, int update,
+        const std::pair<UInt64, UInt64> *key, const Lib7ZipManifest &manifest) {
+    Tcl_StatBuf *stat = Tcl_AllocStatBuf();
+    bool same = Tcl_FSStat(fileObj, stat) == 0 && (stat->st_mode & S_IFMT) == S_IFREG &&
+        (UInt64)stat->st_size == item->GetSize();
+    if (same && update == UPDATE_MTIME) {
+        UInt64 filetime;
+        same = item->GetFileTimeProperty(lib7zip::kpidMTime, filetime) &&
+            (Tcl_WideInt)stat->st_mtime == Time_FileTimeToUnixTime64(filetime);
+    } else if (same && update == UPDATE_CHECKSUM) {
+        Lib7ZipManifest::const_iterator entry = manifest.find(ItemPath(item));
+        same = key && entry != manifest.end() && entry->second == *key;
+    }
+    ckfree((char *)stat);
+    return same;
+}
+
+void Lib7ZipArchiveCmd::LocateChecksums(Lib7ZipChecksums &checksums) {
+    // NOTE: lib7zip has no CRC property, the zip central directory has them for every item
+    UInt64 pos;
+    if (!stream || stream->Seek(0, SEEK_CUR, &pos) != 0)
+        return;
+    std::vector<std::string> types;
+    if (Lib7ZipIdentify(stream, types) && !types.empty())
+        Lib7ZipLocateChecksums(stream, types[0], checksums);
+    stream->Seek((__int64)pos, SEEK_SET, NULL);
+}
+
+bool Lib7ZipArchiveCmd::ItemChecksum(C7ZipArchiveItem *item, Lib7ZipChecksums &checksums, UInt64 *checksum) {
+    if (item->IsEncrypted())
+        return false;
+    Lib7ZipChecksums::iterator crc = checksums.find(ItemPath(item));
+    if (crc != checksums.end()) {
+        *checksum = crc->second;
+        return true;
+    }
+    return item->GetUInt64Property(lib7zip::kpidChecksum, *checksum);
+}
+
+bool Lib7ZipArchiveCmd::FindItem(Tcl_Obj *source, unsigned int *index) {
+    unsigned int count;
+    if (!archive->GetItemCount(&count)) // NOTE: always OK
+        return false;
+    for (unsigned int i = 0; i < count; ++i) {
+        C7ZipArchiveItem *item;
+        if (!archive->GetItemInfo(i, &item) || item->IsDir())
+            continue;
+        if (ItemPath(item) == Tcl_GetString(source)) {
+            *index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Lib7ZipArchiveCmd::ItemIndex(Tcl_Obj *source, bool byindex, unsigned int *index) {
+    if (!byindex) {
+        if (FindItem(source, index))
+            return true;
+        Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("no such item \"%s\" in the archive", Tcl_GetString(source)));
+        return false;
+    }
+    // NOTE: the index as returned by "list -indices", duplicate paths are addressed this way
+    int i;
+    unsigned int count;
+    C7ZipArchiveItem *item;
+    if (Tcl_GetIntFromObj(NULL, source, &i) == TCL_OK && i >= 0 &&
+            archive->GetItemCount(&count) && (unsigned int)i < count &&
+            archive->GetItemInfo((unsigned int)i, &item) && !item->IsDir()) {
+        *index = (unsigned int)i;
+        return true;
+    }
+    Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("no such item index \"%s\" in the archive", Tcl_GetString(source)));
+    return false;
+}
+
+std::string Lib7ZipArchiveCmd::ItemPath(C7ZipArchiveItem *item) {
+#ifdef _WIN32
+    return Path_WindowsPathToUnixPath(convert.to_bytes(item->GetFullPath()).c_str());
+#else
+    return convert.to_bytes(item->GetFullPath()).c_str();
+#endif
+}
+
+int Lib7ZipArchiveCmd::TimeoutOption (Tcl_Obj *obj, Tcl_WideInt *timeout) {
+    if (obj && Tcl_GetWideIntFromObj(NULL, obj, timeout) == TCL_OK && *timeout >= 0)
+        return TCL_OK;
+    Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+        "\"-timeout\" option must be followed by milliseconds", -1));
+    return TCL_ERROR;
+}
+
 bool Lib7ZipArchiveCmd::Valid () {
     if (archive)
         return true;
@@ -406,6 +1647,130 @@ bool Lib7ZipArchiveCmd::Valid () {
     return false;
 }
 
+static void Lib7ZipTestItems(C7ZipArchive *archive, std::vector<Lib7ZipTestTask> &tasks,
+        size_t first, size_t step, const std::wstring *password, Lib7ZipCancel *cancel) {
+    for (size_t i = first; i < tasks.size(); i += step) {
+        Lib7ZipTestTask &task = tasks[i];
+        if (task.done)
+            continue;
+        if (cancel->Check() != Lib7ZipCancel::CANCEL_NONE)
+            break;
+        C7ZipArchiveItem *item;
+        if (!archive->GetItemInfo(task.index, &item))
+            continue;
+        Lib7ZipNullOutStream *out = new Lib7ZipNullOutStream();
+        out->SetCancel(cancel);
+        task.ok = password ? archive->Extract(item, out, *password) : archive->Extract(item, out);
+        task.bytes = out->Size();
+        // NOTE: a wrong password may produce no output and no error
+        UInt64 size;
+        if (task.ok && item->GetUInt64Property(lib7zip::kpidSize, size) && size != task.bytes)
+            task.ok = false;
+        task.done = true;
+        delete out;
+    }
+}
+
+#ifdef TCL_THREADS
+static Tcl_ThreadCreateType Lib7ZipTestThread(ClientData clientData) {
+    Lib7ZipTestWorker *worker = (Lib7ZipTestWorker *)clientData;
+    std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
+    DEBUGLOG("Lib7ZipTestThread " << worker->first << " of " << worker->step);
+    // NOTE: workers share the loaded library, each opens its own archive instance
+    Tcl_Obj *fileObj = Tcl_NewStringObj(convert.to_bytes(worker->file).c_str(), -1);
+    Tcl_Obj *extObj = Tcl_NewStringObj(convert.to_bytes(worker->ext).c_str(), -1);
+    Tcl_IncrRefCount(fileObj);
+    Tcl_IncrRefCount(extObj);
+    Lib7ZipInStream *stream = new Lib7ZipInStream(NULL, fileObj, extObj, false);
+    stream->SetCancel(worker->cancel);
+    Tcl_DecrRefCount(fileObj);
+    Tcl_DecrRefCount(extObj);
+    C7ZipArchive *archive = NULL;
+    if (stream->Valid() &&
+            (worker->library->OpenArchive(stream, &archive, worker->password, false, NULL) ||
+            worker->library->OpenArchive(stream, &archive, worker->password, true, NULL))) {
+        Lib7ZipTestItems(archive, *worker->tasks, worker->first, worker->step,
+            worker->password.empty() ? NULL : &worker->password, worker->cancel);
+        archive->Close();
+        delete archive;
+    }
+    delete stream;
+    Tcl_FinalizeThread();
+    TCL_THREAD_CREATE_RETURN;
+}
+#endif
+
+static int Lib7ZipCreateDirectory(Tcl_Interp *interp, Tcl_Obj *path) {
+    if (Tcl_FSCreateDirectory(path) == TCL_OK)
+        return TCL_OK;
+    int error = Tcl_GetErrno();
+    Tcl_StatBuf *stat = Tcl_AllocStatBuf();
+    bool isdir = Tcl_FSStat(path, stat) == 0 && (stat->st_mode & S_IFMT) == S_IFDIR;
+    ckfree((char *)stat);
+    if (isdir)
+        return TCL_OK;
+    Tcl_SetErrno(error);
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+        "can't create directory \"%s\": %s", Tcl_GetString(path), Tcl_PosixError(interp)));
+    return TCL_ERROR;
+}
+
+// NOTE: the file is sized before decoding, a failed extraction would leave it full of zeros,
+// a device given as the destination stays
+
+static void Lib7ZipRemovePartial(Tcl_Obj *file) {
+    Tcl_StatBuf *stat = Tcl_AllocStatBuf();
+    if (Tcl_FSStat(file, stat) == 0 && (stat->st_mode & S_IFMT) == S_IFREG)
+        Tcl_FSDeleteFile(file);
+    ckfree((char *)stat);
+}
+
+// NOTE: one "checksum size path" line per item, the path last so it may hold spaces
+
+static int Lib7ZipReadManifest(Tcl_Interp *interp, Tcl_Obj *file, Lib7ZipManifest &manifest) {
+    // the first update starts without one
+    Tcl_StatBuf *stat = Tcl_AllocStatBuf();
+    bool exists = Tcl_FSStat(file, stat) == 0;
+    ckfree((char *)stat);
+    if (!exists)
+        return TCL_OK;
+    Tcl_Channel channel = Tcl_FSOpenFileChannel(interp, file, "r", 0);
+    if (!channel)
+        return TCL_ERROR;
+    Tcl_SetChannelOption(NULL, channel, "-encoding", "utf-8");
+    Tcl_Obj *line = Tcl_NewObj();
+    Tcl_IncrRefCount(line);
+    while (Tcl_GetsObj(channel, line) >= 0) {
+        const char *text = Tcl_GetString(line);
+        char *end;
+        UInt64 checksum = strtoull(text, &end, 16);
+        if (*end == ' ') {
+            UInt64 size = strtoull(end + 1, &end, 10);
+            if (*end == ' ' && end[1] != 0)
+                manifest[end + 1] = std::make_pair(size, checksum);
+        }
+        Tcl_SetObjLength(line, 0);
+    }
+    Tcl_DecrRefCount(line);
+    return Tcl_Close(interp, channel);
+}
+
+static int Lib7ZipWriteManifest(Tcl_Interp *interp, Tcl_Obj *file, const Lib7ZipManifest &manifest) {
+    Tcl_Channel channel = Tcl_FSOpenFileChannel(interp, file, "w", 0666);
+    if (!channel)
+        return TCL_ERROR;
+    Tcl_SetChannelOption(NULL, channel, "-encoding", "utf-8");
+    Tcl_SetChannelOption(NULL, channel, "-translation", "lf");
+    for (Lib7ZipManifest::const_iterator m = manifest.begin(); m != manifest.end(); ++m) {
+        Tcl_Obj *line = Tcl_ObjPrintf("%llx %llu %s\n", (unsigned long long)m->second.second,
+            (unsigned long long)m->second.first, m->first.c_str());
+        Tcl_IncrRefCount(line);
+        Tcl_WriteObj(channel, line);
+        Tcl_DecrRefCount(line);
+    }
+    return Tcl_Close(interp, channel);
+}
+
 static int Tcl_StringCaseEqual(const char *str1, const char *str2, int nocase) {
     Tcl_Size len1 = Tcl_NumUtfChars(str1, -1);
     Tcl_Size len2 = Tcl_NumUtfChars(str2, -1);
@@ -438,8 +1803,38 @@ static Int64 Time_FileTimeToUnixTime64(UInt64 filetime)
     return (Int64)(winTime / kNumTimeQuantumsInSecond) - (Int64)kUnixTimeOffset;
 }
 
+static bool Path_IsSafe(const std::string &path) {
+    // NOTE: absolute paths and parent references would escape the target directory
+    if (path.empty() || path[0] == '/')
+        return false;
+#ifdef _WIN32
+    if (path.size() > 1 && path[1] == ':')
+        return false;
+#endif
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos)
+            end = path.size();
+        if (path.compare(start, end - start, "..") == 0)
+            return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+static int Attrib_ToMode(UInt64 attrib) {
+    // FILE_ATTRIBUTE_UNIX_EXTENSION: unix mode is stored in the high word
+    if (attrib & 0x8000)
+        return (int)((attrib >> 16) & 07777);
+    // FILE_ATTRIBUTE_READONLY
+    if (attrib & 0x0001)
+        return 0444;
+    return -1;
+}
+
 #ifdef _WIN32
-static std::string Path_WindowsPathToUnixPath(std::string path) {
+std::string Path_WindowsPathToUnixPath(std::string path) {
     for (int i = 0; i < path.size(); i++)
     if (path[i] == '\\')
         if (i < (path.size()-1) && path[i+1] == '\\')
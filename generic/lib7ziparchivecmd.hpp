@@ -3,39 +3,98 @@
 
 #include <locale>
 #include <codecvt>
+#include <string>
+#include <vector>
+#include <map>
 #include <lib7zip.h>
 #include <tcl.h>
 
 #include "tclcmd.hpp"
 #include "lib7zipstream.hpp"
+#include "lib7ziplocator.hpp"
+
+enum {
+    PROPERTY_NUMBER,
+    PROPERTY_BOOL,
+    PROPERTY_STRING,
+    PROPERTY_TIME
+};
+
+typedef struct {
+    int prop;
+    int type;
+    UInt64 number;
+    std::string text;
+} Lib7ZipItemProperty;
+
+typedef std::vector<Lib7ZipItemProperty> Lib7ZipItemProperties;
 
 class Lib7ZipArchiveCmd : public TclCmd {
 
 public:
 
     Lib7ZipArchiveCmd (Tcl_Interp *interp, const char *name, TclCmd *parent,
-        C7ZipArchive *archive, Lib7ZipInStream *stream);
+        C7ZipArchive *archive, C7ZipInStream *stream, const std::wstring &password);
 
     Lib7ZipArchiveCmd (Tcl_Interp *interp, const char *name, TclCmd *parent,
-        C7ZipArchive *archive, Lib7ZipMultiVolumes *volumes);
+        C7ZipArchive *archive, Lib7ZipMultiVolumes *volumes, const std::wstring &password);
 
     virtual ~Lib7ZipArchiveCmd();
 
+    static void ClearPassword(std::wstring &password);
+
 private:
 
     C7ZipArchive *archive;
-    Lib7ZipInStream *stream;
+    C7ZipInStream *stream;
     Lib7ZipMultiVolumes *volumes;
+    std::wstring password;
+    Lib7ZipStoredItems *stored;
+    bool busy;
+    std::string handle;
+    Lib7ZipCancel cancel;
     std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
 
     int Info(Tcl_Obj *info);
-    int List(Tcl_Obj *list, Tcl_Obj *pattern, char type, int flags, bool info);
-    int Extract(Tcl_Obj *source, Tcl_Obj *destination, Tcl_Obj *password, bool usechannel);
+    int List(Tcl_Obj *list, Tcl_Obj *pattern, char type, int flags, bool info, Tcl_WideInt peek);
+    int Extract(Tcl_Obj *source, bool byindex, Tcl_Obj *destination, Tcl_Obj *password,
+        bool usechannel, int hashes, Tcl_WideInt highwater, bool sparse, int preserve);
+    int ExtractAll(Tcl_Obj *result, Tcl_Obj *todir, Tcl_Obj *pattern, Tcl_Obj *password, int preserve,
+        int dedupe, int update, Tcl_Obj *manifestFile);
+    int Test(Tcl_Obj *result, Tcl_Obj *pattern, Tcl_Obj *password, int workers);
+    int Open(Tcl_Obj *source, bool byindex, Tcl_Obj *password, bool seekable, Tcl_WideInt maxmemory);
+    int Read(Tcl_Obj *source, bool byindex, Tcl_Obj *password, Tcl_WideInt limit);
+    int Grep(Tcl_Obj *result, Tcl_Obj *pattern, Tcl_Obj *itemPattern, int flags, Tcl_Obj *password);
+
+    std::string ItemPath(C7ZipArchiveItem *item);
+    std::wstring ItemPassword(Tcl_Obj *passwordObj);
+    bool ExtractItem(unsigned int index, C7ZipOutStream *out, const std::wstring &pwd);
+    bool ExtractFile(unsigned int index, Lib7ZipOutStream *out, const std::wstring &pwd);
+    bool SameContent(unsigned int index, const std::wstring &pwd, std::pair<Tcl_Obj *, std::string> &source);
+    int CopyStored(C7ZipArchiveItem *item, Lib7ZipOutStream *out);
+    int WriteError(Tcl_Obj *file);
+    void RestoreMetadata(C7ZipArchiveItem *item, Lib7ZipOutStream *out, int preserve);
+    const Lib7ZipStoredItem *StoredItem(C7ZipArchiveItem *item);
+    bool Unchanged(C7ZipArchiveItem *item, Tcl_Obj *fileObj, int update,
+        const std::pair<UInt64, UInt64> *key, const std::map<std::string, std::pair<UInt64, UInt64> > &manifest);
+    void LocateChecksums(Lib7ZipChecksums &checksums);
+    bool ItemChecksum(C7ZipArchiveItem *item, Lib7ZipChecksums &checksums, UInt64 *checksum);
+    bool FindItem(Tcl_Obj *source, unsigned int *index);
+    bool ItemIndex(Tcl_Obj *source, bool byindex, unsigned int *index);
 
     bool Valid ();
+    int TimeoutOption (Tcl_Obj *obj, Tcl_WideInt *timeout);
 
     virtual int Command (int objc, Tcl_Obj * const objv[]);
     virtual void Cleanup();
 };
 
+void Lib7ZipGetItemProperties(C7ZipArchiveItem *item, std::wstring_convert<std::codecvt_utf8<wchar_t>> &convert,
+    Lib7ZipItemProperties &props);
+Tcl_Obj *Lib7ZipNewItemPropertiesObj(const Lib7ZipItemProperties &props);
+
+#ifdef _WIN32
+std::string Path_WindowsPathToUnixPath(std::string path);
+#endif
+
 #endif
@@ -0,0 +1,109 @@
+#include <locale>
+#include <codecvt>
+#include "lib7zipcatalog.hpp"
+
+#if defined(LIB7ZIPCATALOG_DEBUG)
+#   include <iostream>
+#   define DEBUGLOG(_x_) (std::cerr << "DEBUG: " << _x_ << "\n")
+#else
+#   define DEBUGLOG(_x_)
+#endif
+
+Lib7ZipCatalog::Lib7ZipCatalog(const std::wstring &library, const std::wstring &password, Lib7ZipCancel *cancel):
+        library(library), password(password), cancel(cancel), entries(), next(0), mutex(NULL) {
+    DEBUGLOG("Lib7ZipCatalog");
+}
+
+Lib7ZipCatalog::~Lib7ZipCatalog() {
+    DEBUGLOG("~Lib7ZipCatalog");
+    Lib7ZipArchiveCmd::ClearPassword(password);
+    Tcl_MutexFinalize(&mutex);
+}
+
+void Lib7ZipCatalog::Add(const std::string &file) {
+    Lib7ZipCatalogEntry entry;
+    entry.file = file;
+    entry.done = false;
+    entry.valid = false;
+    entry.ok = false;
+    entry.error = lib7zip::LIB7ZIP_NO_ERROR;
+    entries.push_back(entry);
+}
+
+int Lib7ZipCatalog::Run(int workers) {
+    if ((size_t)workers > entries.size())
+        workers = entries.size() > 0 ? (int)entries.size() : 1;
+#ifdef TCL_THREADS
+    std::vector<Tcl_ThreadId> threads;
+    for (int w = 1; w < workers; w++) {
+        Tcl_ThreadId id;
+        if (Tcl_CreateThread(&id, Thread, this, TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) == TCL_OK)
+            threads.push_back(id);
+    }
+    // NOTE: the calling thread is one of the workers
+    Work();
+    for (size_t w = 0; w < threads.size(); w++) {
+        int state;
+        Tcl_JoinThread(threads[w], &state);
+    }
+    return (int)threads.size() + 1;
+#else
+    Work();
+    return 1;
+#endif
+}
+
+Lib7ZipCatalogEntry *Lib7ZipCatalog::Next() {
+    Lib7ZipCatalogEntry *entry = NULL;
+    Tcl_MutexLock(&mutex);
+    if (next < entries.size() && cancel->Check() == Lib7ZipCancel::CANCEL_NONE)
+        entry = &entries[next++];
+    Tcl_MutexUnlock(&mutex);
+    return entry;
+}
+
+void Lib7ZipCatalog::Work() {
+    C7ZipLibrary lib;
+    if (!(library.empty() ? lib.Initialize() : lib.Initialize(library.c_str())))
+        return;
+    std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
+    Lib7ZipCatalogEntry *entry;
+    while ((entry = Next()) != NULL) {
+        DEBUGLOG("Lib7ZipCatalog::Work " << entry->file);
+        Tcl_Obj *fileObj = Tcl_NewStringObj(entry->file.c_str(), -1);
+        Tcl_IncrRefCount(fileObj);
+        Lib7ZipInStream *stream = new Lib7ZipInStream(NULL, fileObj, NULL, false);
+        Tcl_DecrRefCount(fileObj);
+        entry->valid = stream->Valid();
+        if (entry->valid) {
+            stream->SetCancel(cancel);
+            C7ZipArchive *archive = NULL;
+            if (lib.OpenArchive(stream, &archive, password, false) ||
+                    lib.OpenArchive(stream, &archive, password, true)) {
+                unsigned int count = 0;
+                archive->GetItemCount(&count);
+                entry->items.resize(count);
+                for (unsigned int i = 0; i < count; i++) {
+                    C7ZipArchiveItem *item;
+                    if (archive->GetItemInfo(i, &item))
+                        Lib7ZipGetItemProperties(item, convert, entry->items[i]);
+                }
+                archive->Close();
+                delete archive;
+                entry->ok = true;
+            } else {
+                entry->error = lib.GetLastError();
+            }
+        }
+        delete stream;
+        entry->done = true;
+    }
+}
+
+#ifdef TCL_THREADS
+Tcl_ThreadCreateType Lib7ZipCatalog::Thread(ClientData clientData) {
+    ((Lib7ZipCatalog *)clientData)->Work();
+    Tcl_FinalizeThread();
+    TCL_THREAD_CREATE_RETURN;
+}
+#endif
@@ -0,0 +1,55 @@
+#ifndef LIB7ZIPCATALOG_H
+#define LIB7ZIPCATALOG_H
+
+#include <string>
+#include <vector>
+#include <lib7zip.h>
+#include <tcl.h>
+
+#include "lib7zipstream.hpp"
+#include "lib7ziparchivecmd.hpp"
+
+typedef struct {
+    std::string file;
+    bool done;
+    bool valid;
+    bool ok;
+    lib7zip::ErrorCodeEnum error;
+    std::vector<Lib7ZipItemProperties> items;
+} Lib7ZipCatalogEntry;
+
+// Opens many archives and reads the properties of their items in a pool of threads.
+// Every worker loads its own library instance, so the header parsing is not serialized
+// by the shared library lock. The workers take the next file as soon as they are done.
+
+class Lib7ZipCatalog {
+
+public:
+
+    Lib7ZipCatalog(const std::wstring &library, const std::wstring &password, Lib7ZipCancel *cancel);
+
+    ~Lib7ZipCatalog();
+
+    void Add(const std::string &file);
+    int Run(int workers);
+
+    size_t Size() {return entries.size();};
+    const Lib7ZipCatalogEntry &Entry(size_t i) {return entries[i];};
+
+private:
+
+    std::wstring library;
+    std::wstring password;
+    Lib7ZipCancel *cancel;
+    std::vector<Lib7ZipCatalogEntry> entries;
+    size_t next;
+    Tcl_Mutex mutex;
+
+    Lib7ZipCatalogEntry *Next();
+    void Work();
+#ifdef TCL_THREADS
+    static Tcl_ThreadCreateType Thread(ClientData clientData);
+#endif
+};
+
+#endif
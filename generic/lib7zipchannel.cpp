@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "lib7zipchannel.hpp"
+#include "lib7ziplibrary.hpp"
+
+#if defined(LIB7ZIPCHANNEL_DEBUG)
+#   include <iostream>
+#   define DEBUGLOG(_x_) (std::cerr << "DEBUG: " << _x_ << "\n")
+#else
+#   define DEBUGLOG(_x_)
+#endif
+
+const Tcl_ChannelType Lib7ZipChannel::channelType = {
+    "sevenzip",
+    TCL_CHANNEL_VERSION_5,
+    TCL_CLOSE2PROC,
+    InputProc,
+    OutputProc,
+#if TCL_MAJOR_VERSION < 9
+    SeekProc,
+#else
+    NULL,
+#endif
+    NULL,                       // setOptionProc
+    NULL,                       // getOptionProc
+    WatchProc,
+    GetHandleProc,
+    CloseProc,
+    NULL,                       // blockModeProc
+    NULL,                       // flushProc
+    NULL,                       // handlerProc
+    WideSeekProc,
+    NULL,                       // threadActionProc
+    NULL                        // truncateProc
+};
+
+Tcl_Channel Lib7ZipChannel::OpenRange(Tcl_Interp *interp, Tcl_Obj *file, UInt64 offset, UInt64 size) {
+    // NOTE: own channel to the archive file, the handle may be closed before this one
+    Tcl_Channel base = Tcl_FSOpenFileChannel(interp, file, "r", 0);
+    if (base == NULL)
+        return NULL;
+    if (Tcl_SetChannelOption(interp, base, "-translation", "binary") != TCL_OK) {
+        Tcl_Close(NULL, base);
+        return NULL;
+    }
+    return Create(interp, new Lib7ZipChannel(base, NULL, offset, size));
+}
+
+Tcl_Channel Lib7ZipChannel::OpenData(Tcl_Interp *interp, Tcl_Obj *data) {
+    Tcl_Size length;
+    Tcl_GetByteArrayFromObj(data, &length);
+    return Create(interp, new Lib7ZipChannel(NULL, data, 0, (UInt64)length));
+}
+
+Lib7ZipChannel::Lib7ZipChannel(Tcl_Channel base, Tcl_Obj *data, UInt64 offset, UInt64 size):
+        base(base), data(data), offset(offset), size(size), pos(0), basepos(~(UInt64)0),
+        channel(NULL), timer(NULL) {
+    DEBUGLOG("Lib7ZipChannel at " << offset << " size " << size << (base ? " range" : " data"));
+    if (data)
+        Tcl_IncrRefCount(data);
+}
+
+Lib7ZipChannel::~Lib7ZipChannel() {
+    DEBUGLOG("~Lib7ZipChannel");
+    if (timer)
+        Tcl_DeleteTimerHandler(timer);
+    if (base)
+        Tcl_Close(NULL, base);
+    if (data)
+        Tcl_DecrRefCount(data);
+}
+
+Tcl_Channel Lib7ZipChannel::Create(Tcl_Interp *interp, Lib7ZipChannel *instance) {
+    char name[32];
+    snprintf(name, sizeof(name), "sevenzipchan%lu", Lib7ZipLibrary::NextHandle());
+    instance->channel = Tcl_CreateChannel(&channelType, name, instance, TCL_READABLE);
+    Tcl_RegisterChannel(interp, instance->channel);
+    Tcl_SetChannelOption(NULL, instance->channel, "-translation", "binary");
+    return instance->channel;
+}
+
+int Lib7ZipChannel::CloseProc(ClientData instanceData, Tcl_Interp *interp, int flags) {
+    if ((flags & (TCL_CLOSE_READ | TCL_CLOSE_WRITE)) != 0)
+        return EINVAL;
+    delete (Lib7ZipChannel *)instanceData;
+    return 0;
+}
+
+int Lib7ZipChannel::InputProc(ClientData instanceData, char *buf, int toRead, int *errorCodePtr) {
+    Lib7ZipChannel *c = (Lib7ZipChannel *)instanceData;
+    if (c->pos >= c->size || toRead <= 0)
+        return 0;
+    if ((UInt64)toRead > c->size - c->pos)
+        toRead = (int)(c->size - c->pos);
+    if (c->data) {
+        memcpy(buf, Tcl_GetByteArrayFromObj(c->data, NULL) + c->pos, (size_t)toRead);
+        c->pos += toRead;
+        return toRead;
+    }
+    // NOTE: sequential reads continue where the previous one stopped, without a seek
+    if (c->basepos != c->offset + c->pos) {
+        if (Tcl_Seek(c->base, (Tcl_WideInt)(c->offset + c->pos), SEEK_SET) < 0) {
+            *errorCodePtr = Tcl_GetErrno();
+            c->basepos = ~(UInt64)0;
+            return -1;
+        }
+        c->basepos = c->offset + c->pos;
+    }
+    Tcl_Size read = Tcl_Read(c->base, buf, toRead);
+    if (read < 0) {
+        *errorCodePtr = Tcl_GetErrno();
+        c->basepos = ~(UInt64)0;
+        return -1;
+    }
+    c->pos += read;
+    c->basepos += read;
+    return (int)read;
+}
+
+int Lib7ZipChannel::OutputProc(ClientData instanceData, const char *buf, int toWrite, int *errorCodePtr) {
+    *errorCodePtr = EINVAL;
+    return -1;
+}
+
+#if TCL_MAJOR_VERSION < 9
+int Lib7ZipChannel::SeekProc(ClientData instanceData, long offset, int seekMode, int *errorCodePtr) {
+    return (int)WideSeekProc(instanceData, offset, seekMode, errorCodePtr);
+}
+#endif
+
+Tcl_WideInt Lib7ZipChannel::WideSeekProc(ClientData instanceData, Tcl_WideInt offset, int seekMode, int *errorCodePtr) {
+    Lib7ZipChannel *c = (Lib7ZipChannel *)instanceData;
+    Tcl_WideInt origin;
+    switch (seekMode) {
+    case SEEK_SET: origin = 0; break;
+    case SEEK_CUR: origin = (Tcl_WideInt)c->pos; break;
+    case SEEK_END: origin = (Tcl_WideInt)c->size; break;
+    default:
+        *errorCodePtr = EINVAL;
+        return -1;
+    }
+    if (origin + offset < 0) {
+        *errorCodePtr = EINVAL;
+        return -1;
+    }
+    // NOTE: only the position moves, the data is read on demand
+    c->pos = (UInt64)(origin + offset);
+    return (Tcl_WideInt)c->pos;
+}
+
+// The item is always readable, so the watch just keeps a zero timer
+// that notifies the channel while the readable events are wanted.
+
+void Lib7ZipChannel::WatchProc(ClientData instanceData, int mask) {
+    Lib7ZipChannel *c = (Lib7ZipChannel *)instanceData;
+    if (mask & TCL_READABLE) {
+        if (!c->timer)
+            c->timer = Tcl_CreateTimerHandler(0, TimerProc, c);
+    } else if (c->timer) {
+        Tcl_DeleteTimerHandler(c->timer);
+        c->timer = NULL;
+    }
+}
+
+void Lib7ZipChannel::TimerProc(ClientData clientData) {
+    Lib7ZipChannel *c = (Lib7ZipChannel *)clientData;
+    c->timer = NULL;
+    Tcl_NotifyChannel(c->channel, TCL_READABLE);
+}
+
+int Lib7ZipChannel::GetHandleProc(ClientData instanceData, int direction, ClientData *handlePtr) {
+    return TCL_ERROR;
+}
@@ -0,0 +1,48 @@
+#ifndef LIB7ZIPCHANNEL_H
+#define LIB7ZIPCHANNEL_H
+
+#include <lib7zip.h>
+#include <tcl.h>
+
+// Read only channel over an archive item. The stored items are read from their
+// range of the archive file, so a seek costs nothing, the others from the decoded data.
+
+class Lib7ZipChannel {
+
+public:
+
+    static Tcl_Channel OpenRange(Tcl_Interp *interp, Tcl_Obj *file, UInt64 offset, UInt64 size);
+    static Tcl_Channel OpenData(Tcl_Interp *interp, Tcl_Obj *data);
+
+private:
+
+    Lib7ZipChannel(Tcl_Channel base, Tcl_Obj *data, UInt64 offset, UInt64 size);
+
+    ~Lib7ZipChannel();
+
+    Tcl_Channel base;
+    Tcl_Obj *data;
+    UInt64 offset;
+    UInt64 size;
+    UInt64 pos;
+    UInt64 basepos;
+    Tcl_Channel channel;
+    Tcl_TimerToken timer;
+
+    static Tcl_Channel Create(Tcl_Interp *interp, Lib7ZipChannel *instance);
+
+    static int CloseProc(ClientData instanceData, Tcl_Interp *interp, int flags);
+    static int InputProc(ClientData instanceData, char *buf, int toRead, int *errorCodePtr);
+    static int OutputProc(ClientData instanceData, const char *buf, int toWrite, int *errorCodePtr);
+#if TCL_MAJOR_VERSION < 9
+    static int SeekProc(ClientData instanceData, long offset, int seekMode, int *errorCodePtr);
+#endif
+    static Tcl_WideInt WideSeekProc(ClientData instanceData, Tcl_WideInt offset, int seekMode, int *errorCodePtr);
+    static void WatchProc(ClientData instanceData, int mask);
+    static int GetHandleProc(ClientData instanceData, int direction, ClientData *handlePtr);
+    static void TimerProc(ClientData clientData);
+
+    static const Tcl_ChannelType channelType;
+};
+
+#endif
@@ -1,6 +1,11 @@
+#include <algorithm>
+#include <wctype.h>
 #include "lib7zipcmd.hpp"
 #include "lib7ziparchivecmd.hpp"
 #include "lib7zipstream.hpp"
+#include "lib7zipsignature.hpp"
+#include "lib7ziplocator.hpp"
+#include "lib7zipcatalog.hpp"
 
 #if defined(LIB7ZIPCMD_DEBUG)
 #   include <iostream>
@@ -9,12 +14,22 @@
 #   define DEBUGLOG(_x_)
 #endif
 
+// NOTE: the tar inside a compressor is decoded in memory up to this size, to a temporary file past it
+#define UNWRAP_MEMORY_MAX (256 * 1024 * 1024)
+
+Lib7ZipCmd::~Lib7ZipCmd () {
+    // NOTE: archive handles must go before the library may be unloaded
+    while (pChildren)
+        delete pChildren;
+    Lib7ZipLibrary::Release(lib);
+}
+
 int Lib7ZipCmd::Command (int objc, Tcl_Obj *const objv[]) {
     static const char *const commands[] = {
-        "initialize", "isinitialized", "extensions", "open", 0L
+        "initialize", "isinitialized", "extensions", "identify", "scan", "open", "list", "diff", "catalog", "cancel", 0L
     };
     enum commands {
-        cmInitialize, cmIsInitialized, cmExtensions, cmOpen
+        cmInitialize, cmIsInitialized, cmExtensions, cmIdentify, cmScan, cmOpen, cmList, cmDiff, cmCatalog, cmCancel
     };
     int index;
 
@@ -43,7 +58,7 @@ int Lib7ZipCmd::Command (int objc, Tcl_Obj *const objv[]) {
     case cmIsInitialized:
 
         if (objc == 2) {
-            Tcl_SetObjResult(tclInterp, Tcl_NewBooleanObj(lib.IsInitialized()));
+            Tcl_SetObjResult(tclInterp, Tcl_NewBooleanObj(lib->IsInitialized()));
         } else {
             Tcl_WrongNumArgs(tclInterp, 2, objv, NULL);
             return TCL_ERROR;
@@ -54,7 +69,7 @@ int Lib7ZipCmd::Command (int objc, Tcl_Obj *const objv[]) {
     case cmExtensions:
 
         if (objc == 2) {
-            if (!lib.IsInitialized() && (Initialize(NULL) != TCL_OK))
+            if (!lib->IsInitialized() && (Initialize(NULL) != TCL_OK))
                 return TCL_ERROR;
             if (SupportedExts(Tcl_GetObjResult(tclInterp)) != TCL_OK) {
                 return TCL_ERROR;
@@ -66,21 +81,111 @@ int Lib7ZipCmd::Command (int objc, Tcl_Obj *const objv[]) {
 
         break;
 
+    case cmIdentify:
+
+        // identify ?-channel? chan | filename
+        if (objc == 3 || objc == 4) {
+            static const char *const options[] = {
+                "-channel", 0L
+            };
+            bool usechannel = false;
+            if (objc == 4) {
+                if (Tcl_GetIndexFromObj(tclInterp, objv[2], options, "option", 0, &index) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                usechannel = true;
+            }
+            if (!lib->IsInitialized() && (Initialize(NULL) != TCL_OK))
+                return TCL_ERROR;
+            Lib7ZipInStream *stream = new Lib7ZipInStream(tclInterp, objv[objc-1], NULL, usechannel);
+            if (!stream->Valid()) {
+                delete stream;
+                return TCL_ERROR;
+            }
+            std::vector<std::string> types;
+            IdentifyTypes(stream, types);
+            delete stream;
+            Tcl_Obj *result = Tcl_NewListObj(0, NULL);
+            for (size_t t = 0; t < types.size(); t++)
+                Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj(types[t].c_str(), -1));
+            Tcl_SetObjResult(tclInterp, result);
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?-channel? filename");
+            return TCL_ERROR;
+        }
+
+        break;
+
+    case cmScan:
+
+        // scan ?-channel? chan | filename
+        if (objc == 3 || objc == 4) {
+            static const char *const options[] = {
+                "-channel", 0L
+            };
+            bool usechannel = false;
+            if (objc == 4) {
+                if (Tcl_GetIndexFromObj(tclInterp, objv[2], options, "option", 0, &index) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                usechannel = true;
+            }
+            // NOTE: no library needed, the signatures are our own
+            Lib7ZipInStream *stream = new Lib7ZipInStream(tclInterp, objv[objc-1], NULL, usechannel);
+            if (!stream->Valid()) {
+                delete stream;
+                return TCL_ERROR;
+            }
+            std::vector<Lib7ZipScanMatch> matches;
+            bool ok = Lib7ZipScan(stream, matches);
+            delete stream;
+            if (!ok) {
+                Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("error reading \"%s\"", Tcl_GetString(objv[objc-1])));
+                return TCL_ERROR;
+            }
+            Tcl_Obj *result = Tcl_NewListObj(0, NULL);
+            for (size_t m = 0; m < matches.size(); m++) {
+                Tcl_ListObjAppendElement(NULL, result, Tcl_NewWideIntObj((Tcl_WideInt)matches[m].offset));
+                Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj(matches[m].type, -1));
+            }
+            Tcl_SetObjResult(tclInterp, result);
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?-channel? filename");
+            return TCL_ERROR;
+        }
+
+        break;
+
     case cmOpen:
 
-        // open ?-multivolume? ?-detecttype|-forcetype? ?-password password? -channel -- chan | filename
+        // open ?-multivolume? ?-volumelimit count? ?-detecttype|-forcetype? ?-password password? ?-unwrap? ?-timeout ms?
+        //      ?-offset position? ?-length size? ?-spool size? ?-channel|-inline? -- chan | bytes | filename
+        // open ?-detecttype|-forcetype? ?-password password? ?-unwrap? ?-timeout ms?
+        //      -reader -size size ?-blocksize size? -- command
         if (objc > 2) {
             static const char *const options[] = {
-                "-multivolume", "-detecttype", "-forcetype", "-password", "-channel", 0L
+                "-multivolume", "-detecttype", "-forcetype", "-password", "-channel", "-unwrap", "-timeout",
+                "-offset", "-length", "-inline", "-reader", "-size", "-blocksize", "-spool", "-volumelimit", 0L
             };
             enum options {
-                opMultivolume, opDetecttype, opForcetype, opPassword, opChannel
+                opMultivolume, opDetecttype, opForcetype, opPassword, opChannel, opUnwrap, opTimeout,
+                opOffset, opLength, opInline, opReader, opSize, opBlocksize, opSpool, opVolumelimit
             };
             int index;
             bool multivolume = false;
             bool detecttype = false;
             bool usechannel = false;
+            bool useinline = false;
+            bool usereader = false;
+            Tcl_WideInt size = -1;
+            Tcl_WideInt blocksize = 65536;
+            Tcl_WideInt spool = -1;
+            Tcl_WideInt volumelimit = 64;
+            bool unwrap = false;
             std::wstring password = L"";
+            Tcl_WideInt timeout = 0;
+            Tcl_WideInt offset = 0;
+            Tcl_WideInt length = -1;
             Tcl_Obj *forcetype = NULL;
             for (int i = 2; i < objc - 1; i++) {
                 if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
@@ -114,6 +219,80 @@ int Lib7ZipCmd::Command (int objc, Tcl_Obj *const objv[]) {
                 case opChannel:
                     usechannel = true;
                     break;
+                case opUnwrap:
+                    unwrap = true;
+                    break;
+                case opTimeout:
+                    if (i < objc - 2 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &timeout) == TCL_OK && timeout >= 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-timeout\" option must be followed by milliseconds", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opOffset:
+                    if (i < objc - 2 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &offset) == TCL_OK && offset >= 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-offset\" option must be followed by position", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opLength:
+                    if (i < objc - 2 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &length) == TCL_OK && length >= 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-length\" option must be followed by size", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opInline:
+                    useinline = true;
+                    break;
+                case opReader:
+                    usereader = true;
+                    break;
+                case opSize:
+                    if (i < objc - 2 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &size) == TCL_OK && size >= 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-size\" option must be followed by size", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opBlocksize:
+                    if (i < objc - 2 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &blocksize) == TCL_OK &&
+                            blocksize > 0 && blocksize <= 16 * 1024 * 1024) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-blocksize\" option must be followed by size up to 16M", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opSpool:
+                    if (i < objc - 2 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &spool) == TCL_OK && spool >= 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-spool\" option must be followed by size", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opVolumelimit:
+                    if (i < objc - 2 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &volumelimit) == TCL_OK &&
+                            volumelimit > 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-volumelimit\" option must be followed by count", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
                 }
             }
             if (detecttype && forcetype != NULL) {
@@ -126,40 +305,107 @@ int Lib7ZipCmd::Command (int objc, Tcl_Obj *const objv[]) {
                     "only one of options \"-multivolume\" or \"-channel\" must be specified", -1));
                 return TCL_ERROR;
             }
+            if (multivolume && (offset > 0 || length >= 0)) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "only one of options \"-multivolume\" or \"-offset\" must be specified", -1));
+                return TCL_ERROR;
+            }
+            if (useinline && (multivolume || usechannel)) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "only one of options \"-multivolume\", \"-channel\" or \"-inline\" must be specified", -1));
+                return TCL_ERROR;
+            }
+            if (usereader && (multivolume || usechannel || useinline)) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "only one of options \"-multivolume\", \"-channel\", \"-inline\" or \"-reader\" must be specified", -1));
+                return TCL_ERROR;
+            }
+            if (usereader != (size >= 0)) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "\"-reader\" and \"-size\" options must be specified together", -1));
+                return TCL_ERROR;
+            }
+            if ((multivolume || useinline || usereader) && spool >= 0) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "\"-spool\" option can not be used with \"-multivolume\", \"-inline\" or \"-reader\"", -1));
+                return TCL_ERROR;
+            }
+            if ((useinline || usereader) && (offset > 0 || length >= 0)) {
+                Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                    "\"-offset\" and \"-length\" options can not be used with \"-inline\" or \"-reader\"", -1));
+                return TCL_ERROR;
+            }
 
-            if (!lib.IsInitialized() && (Initialize(NULL) != TCL_OK))
+            if (!lib->IsInitialized() && (Initialize(NULL) != TCL_OK))
                 return TCL_ERROR;
 
-            static unsigned long archiveCounter = 0;
+            lib7zip::ErrorCodeEnum error;
+            Lib7ZipCancel budget;
+            budget.Start(timeout);
             Tcl_Obj *archiveObj = NULL;
             C7ZipArchive *archive = NULL;
+            C7ZipInStream *stream = NULL;
+            Lib7ZipMultiVolumes *volumes = NULL;
             if (multivolume) {
-                Lib7ZipMultiVolumes *volumes = new Lib7ZipMultiVolumes(tclInterp, objv[objc-1], forcetype);
+                volumes = new Lib7ZipMultiVolumes(tclInterp, objv[objc-1], forcetype, (size_t)volumelimit);
                 if (!volumes->Valid()) {
                     delete volumes;
                     return TCL_ERROR;
                 }
-                if (!lib.OpenMultiVolumeArchive(volumes, &archive, password, detecttype)) {
-                    LastError();
+                if (!lib->OpenMultiVolumeArchive(volumes, &archive, password, detecttype, &error)) {
+                    LastError(error);
                     delete volumes;
                     return TCL_ERROR;
                 }
-                archiveObj = Tcl_ObjPrintf("sevenzip%lu", archiveCounter++);
-                new Lib7ZipArchiveCmd(tclInterp, Tcl_GetString(archiveObj), this, archive, volumes);
+            } else if (usereader) {
+                Lib7ZipReaderInStream *reader;
+                if (OpenReader(objv[objc-1], (UInt64)size, (size_t)blocksize, forcetype, detecttype, password,
+                        &budget, &archive, &reader) != TCL_OK)
+                    return TCL_ERROR;
+                stream = reader;
+            } else if (useinline) {
+                Lib7ZipDataInStream *data;
+                if (OpenData(objv[objc-1], forcetype, detecttype, password, &budget, &archive, &data) != TCL_OK)
+                    return TCL_ERROR;
+                stream = data;
             } else {
-                Lib7ZipInStream *stream = new Lib7ZipInStream(tclInterp, objv[objc-1], forcetype, usechannel);
-                if (!stream->Valid()) {
-                    delete stream;
+                Lib7ZipInStream *file;
+                if (OpenFile(objv[objc-1], forcetype, detecttype, usechannel, password, &budget,
+                        &archive, &file, offset, length, spool) != TCL_OK)
                     return TCL_ERROR;
-                }
-                if (!lib.OpenArchive(stream, &archive, password, detecttype)) {
-                    LastError();
-                    delete stream;
+                stream = file;
+            }
+            if (unwrap) {
+                C7ZipArchive *tarArchive = NULL;
+                Lib7ZipInStream *tarStream = NULL;
+                if (OpenUnwrap(archive, password, &budget, &tarArchive, &tarStream) != TCL_OK) {
+                    archive->Close();
+                    delete archive;
+                    if (stream)
+                        delete stream;
+                    if (volumes)
+                        delete volumes;
                     return TCL_ERROR;
                 }
-                archiveObj = Tcl_ObjPrintf("sevenzip%lu", archiveCounter++);
-                new Lib7ZipArchiveCmd(tclInterp, Tcl_GetString(archiveObj), this, archive, stream);
+                if (tarArchive) {
+                    // NOTE: the compressor layer is not needed anymore
+                    archive->Close();
+                    delete archive;
+                    if (stream)
+                        delete stream;
+                    if (volumes)
+                        delete volumes;
+                    archive = tarArchive;
+                    stream = tarStream;
+                    volumes = NULL;
+                }
             }
+            archiveObj = Tcl_ObjPrintf("sevenzip%lu", Lib7ZipLibrary::NextHandle());
+            if (volumes)
+                new Lib7ZipArchiveCmd(tclInterp, Tcl_GetString(archiveObj), this, archive, volumes, password);
+            else
+                new Lib7ZipArchiveCmd(tclInterp, Tcl_GetString(archiveObj), this, archive, stream, password);
+            Lib7ZipArchiveCmd::ClearPassword(password);
             Tcl_SetObjResult(tclInterp, archiveObj);
         } else {
             Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? filename");
@@ -168,30 +414,225 @@ int Lib7ZipCmd::Command (int objc, Tcl_Obj *const objv[]) {
 
         break;
 
+    case cmList:
+
+        // list ?-info? ?-password password? filename
+        if (objc >= 3) {
+            static const char *const options[] = {
+                "-info", "-password", 0L
+            };
+            enum options {
+                opInfo, opPassword
+            };
+            int index;
+            bool info = false;
+            std::wstring password = L"";
+            for (int i = 2; i < objc - 1; i++) {
+                if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                switch ((enum options)(index)) {
+                case opInfo:
+                    info = true;
+                    break;
+                case opPassword:
+                    if (i < objc - 2) {
+                        password = convert.from_bytes(Tcl_GetString(objv[++i])).c_str();
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-password\" option must be followed by password", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                }
+            }
+            int result = List(objv[objc-1], info, password);
+            Lib7ZipArchiveCmd::ClearPassword(password);
+            if (result != TCL_OK)
+                return TCL_ERROR;
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? filename");
+            return TCL_ERROR;
+        }
+
+        break;
+
+    case cmDiff:
+
+        // diff ?-password password? ?-timeout ms? filename filename
+        if (objc >= 4) {
+            static const char *const options[] = {
+                "-password", "-timeout", 0L
+            };
+            enum options {
+                opPassword, opTimeout
+            };
+            int index;
+            std::wstring password = L"";
+            Tcl_WideInt timeout = 0;
+            for (int i = 2; i < objc - 2; i++) {
+                if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                switch ((enum options)(index)) {
+                case opPassword:
+                    if (i < objc - 3) {
+                        password = convert.from_bytes(Tcl_GetString(objv[++i])).c_str();
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-password\" option must be followed by password", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opTimeout:
+                    if (i < objc - 3 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &timeout) == TCL_OK && timeout >= 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-timeout\" option must be followed by milliseconds", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                }
+            }
+
+            if (!lib->IsInitialized() && (Initialize(NULL) != TCL_OK))
+                return TCL_ERROR;
+
+            Lib7ZipCancel budget;
+            budget.Start(timeout);
+            C7ZipArchive *archives[2] = {NULL, NULL};
+            Lib7ZipInStream *streams[2] = {NULL, NULL};
+            int result = OpenFile(objv[objc-2], NULL, false, false, password, &budget, &archives[0], &streams[0]);
+            if (result == TCL_OK)
+                result = OpenFile(objv[objc-1], NULL, false, false, password, &budget, &archives[1], &streams[1]);
+            if (result == TCL_OK)
+                result = Diff(archives, streams, password, &budget);
+            for (int a = 0; a < 2; a++) {
+                if (archives[a]) {
+                    archives[a]->Close();
+                    delete archives[a];
+                }
+                if (streams[a])
+                    delete streams[a];
+            }
+            Lib7ZipArchiveCmd::ClearPassword(password);
+            if (result != TCL_OK)
+                return TCL_ERROR;
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? filename filename");
+            return TCL_ERROR;
+        }
+
+        break;
+
+    case cmCatalog:
+
+        // catalog ?-workers count? ?-password password? ?-timeout ms? filenames
+        if (objc >= 3) {
+            static const char *const options[] = {
+                "-workers", "-password", "-timeout", 0L
+            };
+            enum options {
+                opWorkers, opPassword, opTimeout
+            };
+            int index;
+            int workers = 1;
+            std::wstring password = L"";
+            Tcl_WideInt timeout = 0;
+            for (int i = 2; i < objc - 1; i++) {
+                if (Tcl_GetIndexFromObj(tclInterp, objv[i], options, "option", 0, &index) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                switch ((enum options)(index)) {
+                case opWorkers:
+                    if (i < objc - 2 && Tcl_GetIntFromObj(NULL, objv[i+1], &workers) == TCL_OK && workers > 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-workers\" option must be followed by positive integer", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opPassword:
+                    if (i < objc - 2) {
+                        password = convert.from_bytes(Tcl_GetString(objv[++i])).c_str();
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-password\" option must be followed by password", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                case opTimeout:
+                    if (i < objc - 2 && Tcl_GetWideIntFromObj(NULL, objv[i+1], &timeout) == TCL_OK && timeout >= 0) {
+                        i++;
+                    } else {
+                        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj(
+                            "\"-timeout\" option must be followed by milliseconds", -1));
+                        return TCL_ERROR;
+                    }
+                    break;
+                }
+            }
+            Tcl_Size filec;
+            Tcl_Obj **filev;
+            if (Tcl_ListObjGetElements(tclInterp, objv[objc-1], &filec, &filev) != TCL_OK)
+                return TCL_ERROR;
+
+            if (!lib->IsInitialized() && (Initialize(NULL) != TCL_OK))
+                return TCL_ERROR;
+
+            if (Catalog(filec, filev, workers, password, timeout) != TCL_OK)
+                return TCL_ERROR;
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "?options? filenames");
+            return TCL_ERROR;
+        }
+
+        break;
+
+    case cmCancel:
+
+        if (objc == 3) {
+            if (!Lib7ZipLibrary::CancelHandle(Tcl_GetString(objv[2]))) {
+                Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                    "can not find archive named \"%s\"", Tcl_GetString(objv[2])));
+                return TCL_ERROR;
+            }
+        } else {
+            Tcl_WrongNumArgs(tclInterp, 2, objv, "handle");
+            return TCL_ERROR;
+        }
+
+        break;
+
     }
 
     return TCL_OK;
 };
 
 int Lib7ZipCmd::Initialize (Tcl_Obj *dll) {
-    if (lib.IsInitialized()) {
+    if (initialized) {
         Tcl_SetObjResult(tclInterp, Tcl_NewStringObj("already initialized", -1));
         return TCL_ERROR;
     }
-    if (dll) {
-        if (lib.Initialize(convert.from_bytes(Tcl_GetString(dll)).c_str())) {
-            return TCL_OK;
-        }
-    } else if (lib.Initialize()) {
+    std::wstring path = dll ? convert.from_bytes(Tcl_GetString(dll)) : std::wstring();
+    // NOTE: another interpreter or thread may have loaded the library, it is shared then
+    if (lib->Initialize(path) || (lib->IsInitialized() && (path.empty() || path == lib->Path()))) {
+        initialized = true;
         return TCL_OK;
     }
+    if (lib->IsInitialized()) {
+        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj("another 7z library is already loaded", -1));
+        return TCL_ERROR;
+    }
     Tcl_SetObjResult(tclInterp, Tcl_NewStringObj("error loading 7z library", -1));
     return TCL_ERROR;
 }
 
 int Lib7ZipCmd::SupportedExts (Tcl_Obj *exts) {
     WStringArray a;
-    if (lib.GetSupportedExts(a)) {
+    if (lib->SupportedExts(a)) {
         for(size_t i = 0; i < a.size(); i++) {
             Tcl_ListObjAppendElement(tclInterp, exts,
                 Tcl_NewStringObj(convert.to_bytes(a[i]).c_str(), -1));
@@ -202,26 +643,444 @@ int Lib7ZipCmd::SupportedExts (Tcl_Obj *exts) {
     return TCL_ERROR;
 }
 
-int Lib7ZipCmd::LastError () {
-    lib7zip::ErrorCodeEnum errorcode = lib.GetLastError();
+void Lib7ZipCmd::IdentifyTypes (C7ZipInStream *stream, std::vector<std::string> &types) {
+    std::vector<std::string> candidates;
+    if (!Lib7ZipIdentify(stream, candidates))
+        return;
+    // NOTE: keep only the types the loaded library has handlers for
+    WStringArray a;
+    lib->SupportedExts(a);
+    for (size_t i = 0; i < candidates.size(); i++) {
+        std::wstring type = convert.from_bytes(candidates[i]);
+        for (size_t j = 0; j < a.size(); j++) {
+            std::wstring ext = a[j];
+            std::transform(ext.begin(), ext.end(), ext.begin(), ::towlower);
+            if (ext == type) {
+                types.push_back(candidates[i]);
+                break;
+            }
+        }
+    }
+    DEBUGLOG("Lib7ZipCmd::IdentifyTypes " << candidates.size() << " candidates, " << types.size() << " supported");
+}
+
+int Lib7ZipCmd::OpenFile (Tcl_Obj *filename, Tcl_Obj *forcetype, bool detecttype, bool usechannel,
+        const std::wstring &password, Lib7ZipCancel *budget, C7ZipArchive **archive, Lib7ZipInStream **stream,
+        Tcl_WideInt offset, Tcl_WideInt length, Tcl_WideInt spool) {
+    lib7zip::ErrorCodeEnum error;
+    Lib7ZipInStream *file = new Lib7ZipInStream(tclInterp, filename, forcetype, usechannel, spool);
+    if (!file->Valid()) {
+        delete file;
+        return TCL_ERROR;
+    }
+    if (offset > 0 || length >= 0) {
+        if (!file->SetRange((UInt64)offset, length >= 0 ? (UInt64)length : ~(UInt64)0)) {
+            Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                "offset %" TCL_LL_MODIFIER "d is beyond the end of \"%s\"", offset, Tcl_GetString(filename)));
+            delete file;
+            return TCL_ERROR;
+        }
+        // NOTE: the extension is the one of the outer file, only the content tells the type
+        detecttype = detecttype || forcetype == NULL;
+    }
+    file->SetCancel(budget);
+    bool opened = false;
+    if (forcetype == NULL && (detecttype || file->GetExt().empty())) {
+        // try the handlers matching the signatures first, one by one
+        std::wstring ext = file->GetExt();
+        std::vector<std::string> types;
+        IdentifyTypes(file, types);
+        for (size_t t = 0; t < types.size() && !opened; t++) {
+            file->SetExt(convert.from_bytes(types[t]));
+            opened = lib->OpenArchive(file, archive, password, false, NULL);
+        }
+        if (!opened)
+            file->SetExt(ext);
+    }
+    if (!opened && !lib->OpenArchive(file, archive, password, detecttype, &error)) {
+        if (!budget->SetError(tclInterp))
+            LastError(error);
+        delete file;
+        return TCL_ERROR;
+    }
+    file->SetCancel(NULL);
+    *stream = file;
+    return TCL_OK;
+}
+
+// Opens the archive held by a byte array, the stream reads the object in place and keeps
+// a reference to it. There is no name to take the extension from, the content tells the type.
+
+int Lib7ZipCmd::OpenData (Tcl_Obj *data, Tcl_Obj *forcetype, bool detecttype,
+        const std::wstring &password, Lib7ZipCancel *budget, C7ZipArchive **archive, Lib7ZipDataInStream **stream) {
+    lib7zip::ErrorCodeEnum error;
+    Lib7ZipDataInStream *bytes = new Lib7ZipDataInStream(data, forcetype);
+    bool opened = false;
+    if (forcetype == NULL) {
+        std::vector<std::string> types;
+        IdentifyTypes(bytes, types);
+        for (size_t t = 0; t < types.size() && !opened; t++) {
+            bytes->SetExt(convert.from_bytes(types[t]));
+            opened = lib->OpenArchive(bytes, archive, password, false, NULL);
+        }
+        if (!opened)
+            bytes->SetExt(L"");
+    }
+    if (!opened && !lib->OpenArchive(bytes, archive, password, detecttype || forcetype == NULL, &error)) {
+        if (!budget->SetError(tclInterp))
+            LastError(error);
+        delete bytes;
+        return TCL_ERROR;
+    }
+    *stream = bytes;
+    return TCL_OK;
+}
+
+// Opens the archive read through a script command, see Lib7ZipReaderInStream.
+// The error of the command, if any, is reported instead of the library one.
+
+int Lib7ZipCmd::OpenReader (Tcl_Obj *command, UInt64 size, size_t blocksize, Tcl_Obj *forcetype, bool detecttype,
+        const std::wstring &password, Lib7ZipCancel *budget, C7ZipArchive **archive, Lib7ZipReaderInStream **stream) {
+    lib7zip::ErrorCodeEnum error;
+    Lib7ZipReaderInStream *reader = new Lib7ZipReaderInStream(tclInterp, command, size, forcetype, blocksize);
+    reader->SetCancel(budget);
+    bool opened = false;
+    if (forcetype == NULL) {
+        std::vector<std::string> types;
+        IdentifyTypes(reader, types);
+        for (size_t t = 0; t < types.size() && !opened && !reader->GetError(); t++) {
+            reader->SetExt(convert.from_bytes(types[t]));
+            opened = lib->OpenArchive(reader, archive, password, false, NULL);
+        }
+        if (!opened)
+            reader->SetExt(L"");
+    }
+    if (!opened && (reader->GetError() ||
+            !lib->OpenArchive(reader, archive, password, detecttype || forcetype == NULL, &error))) {
+        if (reader->GetError())
+            Tcl_SetObjResult(tclInterp, reader->GetError());
+        else if (!budget->SetError(tclInterp))
+            LastError(error);
+        delete reader;
+        return TCL_ERROR;
+    }
+    reader->SetCancel(NULL);
+    *stream = reader;
+    return TCL_OK;
+}
+
+// Lists zip and plain tar archives from their directory, without the 7z.so handlers,
+// the other archives are opened the usual way.
+
+int Lib7ZipCmd::List (Tcl_Obj *filename, bool info, const std::wstring &password) {
+    Lib7ZipInStream *file = new Lib7ZipInStream(tclInterp, filename, NULL, false);
+    if (!file->Valid()) {
+        delete file;
+        return TCL_ERROR;
+    }
+    std::vector<std::string> types;
+    Lib7ZipListItems items;
+    bool native = Lib7ZipIdentify(file, types) && !types.empty() && Lib7ZipLocateList(file, types[0], items);
+    delete file;
+
+    Tcl_Obj *result;
+    if (native) {
+        result = Tcl_NewObj();
+        DEBUGLOG("Lib7ZipCmd::List native " << types[0] << ", " << items.size() << " items");
+        for (size_t i = 0; i < items.size(); i++) {
+            const Lib7ZipListItem &item = items[i];
+            if (!info) {
+                Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj(item.path.c_str(), -1));
+                continue;
+            }
+            // NOTE: in the lib7zip::PropertyIndexEnum order, like "handle list -info"
+            Lib7ZipItemProperties props;
+            Lib7ZipItemProperty packsize = {lib7zip::kpidPackSize, PROPERTY_NUMBER, item.packsize, std::string()};
+            Lib7ZipItemProperty attrib = {lib7zip::kpidAttrib, PROPERTY_NUMBER, item.attrib, std::string()};
+            Lib7ZipItemProperty mtime = {lib7zip::kpidMTime, PROPERTY_TIME, item.mtime, std::string()};
+            Lib7ZipItemProperty encrypted = {lib7zip::kpidEncrypted, PROPERTY_BOOL, item.encrypted, std::string()};
+            Lib7ZipItemProperty path = {lib7zip::kpidPath, PROPERTY_STRING, 0, item.path};
+            Lib7ZipItemProperty isdir = {lib7zip::kpidIsDir, PROPERTY_BOOL, item.isdir, std::string()};
+            Lib7ZipItemProperty size = {lib7zip::kpidSize, PROPERTY_NUMBER, item.size, std::string()};
+            props.push_back(packsize);
+            props.push_back(attrib);
+            if (item.mtime)
+                props.push_back(mtime);
+            props.push_back(encrypted);
+            props.push_back(path);
+            props.push_back(isdir);
+            props.push_back(size);
+            Tcl_ListObjAppendElement(NULL, result, Lib7ZipNewItemPropertiesObj(props));
+        }
+        Tcl_SetObjResult(tclInterp, result);
+        return TCL_OK;
+    }
+
+    if (!lib->IsInitialized() && (Initialize(NULL) != TCL_OK))
+        return TCL_ERROR;
+    Lib7ZipCancel budget;
+    budget.Start(0);
+    C7ZipArchive *archive = NULL;
+    Lib7ZipInStream *stream = NULL;
+    if (OpenFile(filename, NULL, false, false, password, &budget, &archive, &stream) != TCL_OK)
+        return TCL_ERROR;
+    result = Tcl_NewObj();
+    unsigned int count = 0;
+    archive->GetItemCount(&count); // NOTE: always OK
+    for (unsigned int i = 0; i < count; i++) {
+        C7ZipArchiveItem *item;
+        if (!archive->GetItemInfo(i, &item)) // NOTE: always OK
+            continue;
+        if (info) {
+            Lib7ZipItemProperties props;
+            Lib7ZipGetItemProperties(item, convert, props);
+            Tcl_ListObjAppendElement(NULL, result, Lib7ZipNewItemPropertiesObj(props));
+        } else {
+#ifdef _WIN32
+            std::string path = Path_WindowsPathToUnixPath(convert.to_bytes(item->GetFullPath()).c_str());
+#else
+            std::string path = convert.to_bytes(item->GetFullPath()).c_str();
+#endif
+            Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj(path.c_str(), -1));
+        }
+    }
+    archive->Close();
+    delete archive;
+    delete stream;
+    Tcl_SetObjResult(tclInterp, result);
+    return TCL_OK;
+}
+
+// Compares the items by path, size and the checksums kept in the archives. The content
+// is decoded only when a checksum is missing or the two archives keep different kinds.
+
+int Lib7ZipCmd::Diff (C7ZipArchive *archives[2], Lib7ZipInStream *streams[2], const std::wstring &password,
+        Lib7ZipCancel *budget) {
+    Lib7ZipDiffItems items[2];
+    for (int a = 0; a < 2; a++)
+        DiffItems(archives[a], streams[a], items[a]);
+
+    Tcl_Obj *added = Tcl_NewObj();
+    Tcl_Obj *removed = Tcl_NewObj();
+    Tcl_Obj *changed = Tcl_NewObj();
+    Tcl_Obj *result = Tcl_NewObj();
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("added", -1));
+    Tcl_ListObjAppendElement(NULL, result, added);
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("removed", -1));
+    Tcl_ListObjAppendElement(NULL, result, removed);
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("changed", -1));
+    Tcl_ListObjAppendElement(NULL, result, changed);
+    Tcl_IncrRefCount(result);
+
+    int code = TCL_OK;
+    for (Lib7ZipDiffItems::iterator i = items[0].begin(); i != items[0].end() && code == TCL_OK; ++i) {
+        Lib7ZipDiffItems::iterator j = items[1].find(i->first);
+        if (j == items[1].end()) {
+            Tcl_ListObjAppendElement(NULL, removed, Tcl_NewStringObj(i->first.c_str(), -1));
+            continue;
+        }
+        const Lib7ZipDiffItem &a = i->second;
+        const Lib7ZipDiffItem &b = j->second;
+        bool same = a.dir == b.dir && a.size == b.size;
+        if (same && !a.dir) {
+            if (a.kind != DIFF_CHECKSUM_NONE && a.kind == b.kind) {
+                same = a.checksum == b.checksum;
+            } else {
+                // NOTE: a known CRC32 needs only the other side decoded
+                int algorithm = a.kind == DIFF_CHECKSUM_CRC32 || b.kind == DIFF_CHECKSUM_CRC32 ?
+                    Lib7ZipHash::HASH_CRC32 : Lib7ZipHash::HASH_SHA256;
+                std::string digests[2];
+                const Lib7ZipDiffItem *sides[2] = {&a, &b};
+                for (int s = 0; s < 2 && code == TCL_OK; s++) {
+                    if (algorithm == Lib7ZipHash::HASH_CRC32 && sides[s]->kind == DIFF_CHECKSUM_CRC32) {
+                        char hex[9];
+                        snprintf(hex, sizeof(hex), "%08x", (unsigned int)sides[s]->checksum);
+                        digests[s] = hex;
+                    } else if (!DiffDigest(archives[s], sides[s]->index, password, budget, algorithm, digests[s])) {
+                        if (!budget->SetError(tclInterp))
+                            Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                                "error extracting item \"%s\"", i->first.c_str()));
+                        code = TCL_ERROR;
+                    }
+                }
+                same = digests[0] == digests[1];
+            }
+        }
+        if (!same)
+            Tcl_ListObjAppendElement(NULL, changed, Tcl_NewStringObj(i->first.c_str(), -1));
+    }
+    for (Lib7ZipDiffItems::iterator j = items[1].begin(); j != items[1].end(); ++j) {
+        if (items[0].find(j->first) == items[0].end())
+            Tcl_ListObjAppendElement(NULL, added, Tcl_NewStringObj(j->first.c_str(), -1));
+    }
+    if (code == TCL_OK)
+        Tcl_SetObjResult(tclInterp, result);
+    Tcl_DecrRefCount(result);
+    return code;
+}
+
+void Lib7ZipCmd::DiffItems (C7ZipArchive *archive, Lib7ZipInStream *stream, Lib7ZipDiffItems &items) {
+    // NOTE: lib7zip has no CRC property, the zip central directory has them for every item
+    Lib7ZipChecksums checksums;
+    std::vector<std::string> types;
+    if (Lib7ZipIdentify(stream, types) && !types.empty())
+        Lib7ZipLocateChecksums(stream, types[0], checksums);
+    unsigned int count;
+    if (!archive->GetItemCount(&count)) // NOTE: always OK
+        return;
+    for (unsigned int i = 0; i < count; i++) {
+        C7ZipArchiveItem *item;
+        if (!archive->GetItemInfo(i, &item)) // NOTE: always OK
+            continue;
+#ifdef _WIN32
+        std::string path = Path_WindowsPathToUnixPath(convert.to_bytes(item->GetFullPath()).c_str());
+#else
+        std::string path = convert.to_bytes(item->GetFullPath()).c_str();
+#endif
+        Lib7ZipDiffItem entry = {i, item->GetSize(), item->IsDir(), DIFF_CHECKSUM_NONE, 0};
+        UInt64 value;
+        Lib7ZipChecksums::iterator crc = checksums.find(path);
+        if (entry.dir) {
+            entry.size = 0;
+        } else if (crc != checksums.end()) {
+            entry.kind = DIFF_CHECKSUM_CRC32;
+            entry.checksum = crc->second;
+        } else if (item->GetUInt64Property(lib7zip::kpidChecksum, value)) {
+            entry.kind = DIFF_CHECKSUM_PROPERTY;
+            entry.checksum = value;
+        }
+        items[path] = entry;
+    }
+    DEBUGLOG("Lib7ZipCmd::DiffItems " << items.size() << " items, " << checksums.size() << " crc");
+}
+
+bool Lib7ZipCmd::DiffDigest (C7ZipArchive *archive, unsigned int index, const std::wstring &password,
+        Lib7ZipCancel *budget, int algorithm, std::string &digest) {
+    Lib7ZipHash hash(algorithm);
+    Lib7ZipNullOutStream out;
+    out.SetHash(&hash);
+    out.SetCancel(budget);
+    if (!(password.empty() ? archive->Extract(index, &out) : archive->Extract(index, &out, password)))
+        return false;
+    digest = algorithm == Lib7ZipHash::HASH_CRC32 ? hash.Crc32() : hash.Sha256();
+    return true;
+}
+
+int Lib7ZipCmd::Catalog (Tcl_Size filec, Tcl_Obj *const filev[], int workers, std::wstring &password,
+        Tcl_WideInt timeout) {
+    Lib7ZipCancel budget;
+    budget.Start(timeout);
+    Lib7ZipCatalog catalog(lib->Path(), password, &budget);
+    Lib7ZipArchiveCmd::ClearPassword(password);
+    for (Tcl_Size f = 0; f < filec; f++)
+        catalog.Add(Tcl_GetString(filev[f]));
+    catalog.Run(workers);
+    if (budget.SetError(tclInterp))
+        return TCL_ERROR;
+
+    // NOTE: the Tcl objects are made here, the workers only collect plain data
+    Tcl_Obj *result = Tcl_NewObj();
+    for (size_t e = 0; e < catalog.Size(); e++) {
+        const Lib7ZipCatalogEntry &entry = catalog.Entry(e);
+        Tcl_Obj *entryObj = Tcl_NewObj();
+        if (entry.ok) {
+            Tcl_Obj *itemsObj = Tcl_NewObj();
+            for (size_t i = 0; i < entry.items.size(); i++)
+                Tcl_ListObjAppendElement(NULL, itemsObj, Lib7ZipNewItemPropertiesObj(entry.items[i]));
+            Tcl_ListObjAppendElement(NULL, entryObj, Tcl_NewStringObj("items", -1));
+            Tcl_ListObjAppendElement(NULL, entryObj, itemsObj);
+        } else {
+            Tcl_ListObjAppendElement(NULL, entryObj, Tcl_NewStringObj("error", -1));
+            if (!entry.done)
+                Tcl_ListObjAppendElement(NULL, entryObj, Tcl_NewStringObj("error loading 7z library", -1));
+            else if (!entry.valid)
+                Tcl_ListObjAppendElement(NULL, entryObj, Tcl_NewStringObj("couldn't read file", -1));
+            else
+                Tcl_ListObjAppendElement(NULL, entryObj, ErrorObj(entry.error));
+        }
+        Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj(entry.file.c_str(), -1));
+        Tcl_ListObjAppendElement(NULL, result, entryObj);
+    }
+    Tcl_SetObjResult(tclInterp, result);
+    return TCL_OK;
+}
+
+int Lib7ZipCmd::OpenUnwrap (C7ZipArchive *archive, const std::wstring &password, Lib7ZipCancel *cancel,
+        C7ZipArchive **tarArchive, Lib7ZipInStream **tarStream) {
+    *tarArchive = NULL;
+    *tarStream = NULL;
+
+    // compressor formats (gz, bz2, xz, zst, ...) expose exactly one item
+    unsigned int count;
+    C7ZipArchiveItem *item;
+    if (!archive->GetItemCount(&count) || count != 1)
+        return TCL_OK;
+    if (!archive->GetItemInfo(0, &item) || item->IsDir())
+        return TCL_OK;
+
+    // decode the first block only to check whether the content is a tar
+    Lib7ZipDataOutStream *out = new Lib7ZipDataOutStream(TAR_BLOCK_SIZE);
+    out->SetCancel(cancel);
+    if (password.empty())
+        archive->Extract(item, out);
+    else
+        archive->Extract(item, out, password);
+    Tcl_Size length;
+    unsigned char *block = Tcl_GetByteArrayFromObj(out->GetData(), &length);
+    bool istar = Tar_IsHeader(block, length);
+    delete out;
+    if (cancel->SetError(tclInterp))
+        return TCL_ERROR;
+    if (!istar)
+        return TCL_OK;
+
+    Lib7ZipSpoolOutStream *spool = new Lib7ZipSpoolOutStream(UNWRAP_MEMORY_MAX);
+    spool->SetCancel(cancel);
+    if (!(password.empty() ? archive->Extract(item, spool) : archive->Extract(item, spool, password))) {
+        delete spool;
+        if (cancel->SetError(tclInterp))
+            return TCL_ERROR;
+        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj("error decoding wrapped tar archive", -1));
+        return TCL_ERROR;
+    }
+    Tcl_Obj *typeObj = Tcl_NewStringObj("tar", -1);
+    Tcl_IncrRefCount(typeObj);
+    Lib7ZipInStream *stream = spool->Detach(typeObj);
+    Tcl_DecrRefCount(typeObj);
+    delete spool;
+    if (!stream) {
+        Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+            "error spooling wrapped tar archive: %s", Tcl_PosixError(tclInterp)));
+        return TCL_ERROR;
+    }
+    C7ZipArchive *tar = NULL;
+    if (!lib->OpenArchive(stream, &tar, L"", false, NULL)) {
+        delete stream;
+        return TCL_OK;
+    }
+    *tarArchive = tar;
+    *tarStream = stream;
+    return TCL_OK;
+}
+
+int Lib7ZipCmd::LastError (lib7zip::ErrorCodeEnum errorcode) {
+    Tcl_SetObjResult(tclInterp, ErrorObj(errorcode));
+    return TCL_ERROR;
+}
+
+Tcl_Obj *Lib7ZipCmd::ErrorObj (lib7zip::ErrorCodeEnum errorcode) {
     switch (errorcode) {
     case lib7zip::LIB7ZIP_NO_ERROR:
-        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj("no error", -1));
-        break;
+        return Tcl_NewStringObj("no error", -1);
     case lib7zip::LIB7ZIP_UNKNOWN_ERROR:
-        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj("unknown error", -1));
-        break;
+        return Tcl_NewStringObj("unknown error", -1);
     case lib7zip::LIB7ZIP_NOT_INITIALIZE:
-        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj("not initialized", -1));
-        break;
+        return Tcl_NewStringObj("not initialized", -1);
     case lib7zip::LIB7ZIP_NEED_PASSWORD:
-        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj("need password", -1));
-        break;
+        return Tcl_NewStringObj("need password", -1);
     case lib7zip::LIB7ZIP_NOT_SUPPORTED_ARCHIVE:
-        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj("not supported", -1));
-        break;
+        return Tcl_NewStringObj("not supported", -1);
     default:
-        Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf("unknown error %d", errorcode));
+        return Tcl_ObjPrintf("unknown error %d", errorcode);
     };  
-    return TCL_ERROR;
 }
@@ -3,27 +3,71 @@
 
 #include <locale>
 #include <codecvt>
+#include <string>
+#include <vector>
+#include <map>
 #include <lib7zip.h>
 #include <tcl.h>
 
 #include "tclcmd.hpp"
+#include "lib7zipstream.hpp"
+#include "lib7ziplibrary.hpp"
+
+enum {
+    DIFF_CHECKSUM_NONE,
+    DIFF_CHECKSUM_CRC32,
+    DIFF_CHECKSUM_PROPERTY
+};
+
+typedef struct {
+    unsigned int index;
+    UInt64 size;
+    bool dir;
+    int kind;
+    UInt64 checksum;
+} Lib7ZipDiffItem;
+
+typedef std::map<std::string, Lib7ZipDiffItem> Lib7ZipDiffItems;
 
 class Lib7ZipCmd : public TclCmd {
 
 public:
 
-    Lib7ZipCmd (Tcl_Interp * interp, const char * name): TclCmd(interp, name), lib(), convert() {};
+    Lib7ZipCmd (Tcl_Interp * interp, const char * name):
+        TclCmd(interp, name), lib(Lib7ZipLibrary::Acquire()), initialized(false), convert() {};
+
+    virtual ~Lib7ZipCmd ();
 
-    virtual ~Lib7ZipCmd () {};
+    Lib7ZipLibrary *Library () {return lib;};
 
 private:
 
-    C7ZipLibrary lib;
+    Lib7ZipLibrary *lib;
+    bool initialized;
     std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
 
     int Initialize (Tcl_Obj * dll);
     int SupportedExts (Tcl_Obj * exts);
-    int LastError ();
+    void IdentifyTypes (C7ZipInStream *stream, std::vector<std::string> &types);
+    int OpenFile (Tcl_Obj *filename, Tcl_Obj *forcetype, bool detecttype, bool usechannel,
+        const std::wstring &password, Lib7ZipCancel *budget, C7ZipArchive **archive, Lib7ZipInStream **stream,
+        Tcl_WideInt offset = 0, Tcl_WideInt length = -1, Tcl_WideInt spool = -1);
+    int OpenData (Tcl_Obj *data, Tcl_Obj *forcetype, bool detecttype,
+        const std::wstring &password, Lib7ZipCancel *budget, C7ZipArchive **archive, Lib7ZipDataInStream **stream);
+    int OpenReader (Tcl_Obj *command, UInt64 size, size_t blocksize, Tcl_Obj *forcetype, bool detecttype,
+        const std::wstring &password, Lib7ZipCancel *budget, C7ZipArchive **archive, Lib7ZipReaderInStream **stream);
+    int List (Tcl_Obj *filename, bool info, const std::wstring &password);
+    int Diff (C7ZipArchive *archives[2], Lib7ZipInStream *streams[2], const std::wstring &password,
+        Lib7ZipCancel *budget);
+    void DiffItems (C7ZipArchive *archive, Lib7ZipInStream *stream, Lib7ZipDiffItems &items);
+    bool DiffDigest (C7ZipArchive *archive, unsigned int index, const std::wstring &password,
+        Lib7ZipCancel *budget, int algorithm, std::string &digest);
+    int OpenUnwrap (C7ZipArchive *archive, const std::wstring &password, Lib7ZipCancel *cancel,
+        C7ZipArchive **tarArchive, Lib7ZipInStream **tarStream);
+    int Catalog (Tcl_Size filec, Tcl_Obj *const filev[], int workers, std::wstring &password,
+        Tcl_WideInt timeout);
+    int LastError (lib7zip::ErrorCodeEnum errorcode);
+    Tcl_Obj *ErrorObj (lib7zip::ErrorCodeEnum errorcode);
 
     virtual int Command (int objc, Tcl_Obj * const objv[]);
 };
@@ -0,0 +1,214 @@
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+#include "lib7zipgrep.hpp"
+
+#if defined(LIB7ZIPGREP_DEBUG)
+#   include <iostream>
+#   define DEBUGLOG(_x_) (std::cerr << "DEBUG: " << _x_ << "\n")
+#else
+#   define DEBUGLOG(_x_)
+#endif
+
+// NOTE: a line without newline is matched as is once it grows that long
+#define GREP_LINE_MAX (1024 * 1024)
+
+static const char *Mem_Find(const char *hay, size_t size, const char *needle, size_t length);
+static const char *Mem_LastNewline(const char *data, size_t size);
+
+Lib7ZipGrepOutStream::Lib7ZipGrepOutStream(Tcl_Interp *interp, Tcl_Obj *pattern, int flags):
+        tclInterp(interp), pattern(pattern), flags(flags), literal(), regexp(NULL), lineObj(NULL),
+        item(NULL), matches(NULL), pending(), lowered(), offset(0), line(1), found(0),
+        stopped(false), failed(false), cancel(NULL) {
+    DEBUGLOG("Lib7ZipGrepOutStream " << Tcl_GetString(pattern) << " flags " << flags);
+    Tcl_IncrRefCount(pattern);
+    if (flags & GREP_REGEXP) {
+        regexp = Tcl_GetRegExpFromObj(interp, pattern,
+            TCL_REG_ADVANCED | ((flags & GREP_NOCASE) ? TCL_REG_NOCASE : 0));
+        lineObj = Tcl_NewObj();
+        Tcl_IncrRefCount(lineObj);
+    } else {
+        Tcl_Size length;
+        const char *bytes = Tcl_GetStringFromObj(pattern, &length);
+        literal.assign(bytes, (size_t)length);
+        if (flags & GREP_NOCASE)
+            std::transform(literal.begin(), literal.end(), literal.begin(), ::tolower);
+    }
+}
+
+Lib7ZipGrepOutStream::~Lib7ZipGrepOutStream() {
+    DEBUGLOG("~Lib7ZipGrepOutStream");
+    if (lineObj)
+        Tcl_DecrRefCount(lineObj);
+    Tcl_DecrRefCount(pattern);
+}
+
+void Lib7ZipGrepOutStream::Start(Tcl_Obj *itemObj, Tcl_Obj *matchesObj) {
+    item = itemObj;
+    matches = matchesObj;
+    pending.clear();
+    offset = 0;
+    line = 1;
+    found = 0;
+    stopped = false;
+    failed = false;
+}
+
+int Lib7ZipGrepOutStream::Finish() {
+    if (!stopped && !failed && !pending.empty())
+        MatchLines(pending.data(), pending.size());
+    pending.clear();
+    return failed ? 1 : 0;
+}
+
+int Lib7ZipGrepOutStream::Write(const void *data, unsigned int size, unsigned int *processedSize) {
+    if (cancel && cancel->Check() != Lib7ZipCancel::CANCEL_NONE)
+        return 1;
+    if (stopped || failed)
+        return 1;
+    const char *bytes = (const char *)data;
+    size_t rest = size;
+    const char *last = Mem_LastNewline(bytes, rest);
+    if (!last) {
+        pending.append(bytes, rest);
+        if (pending.size() >= GREP_LINE_MAX) {
+            bool more = MatchLines(pending.data(), pending.size());
+            pending.clear();
+            if (!more)
+                return 1;
+        }
+    } else {
+        size_t head = (size_t)(last - bytes) + 1;
+        if (!pending.empty()) {
+            // complete the line left over from the previous block first
+            size_t first = (size_t)((const char *)memchr(bytes, '\n', head) - bytes) + 1;
+            pending.append(bytes, first);
+            bool more = MatchLines(pending.data(), pending.size());
+            pending.clear();
+            if (!more)
+                return 1;
+            bytes += first;
+            rest -= first;
+            head -= first;
+        }
+        if (head > 0 && !MatchLines(bytes, head))
+            return 1;
+        pending.assign(bytes + head, rest - head);
+    }
+    if (processedSize)
+        *processedSize = size;
+    return 0;
+}
+
+int Lib7ZipGrepOutStream::Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition) {
+    DEBUGLOG("Lib7ZipGrepOutStream::Seek " << offset << " as " << seekOrigin);
+    return 1;
+}
+
+int Lib7ZipGrepOutStream::SetSize(UInt64 size) {
+    return 0;
+}
+
+// Searches whole lines, the last one may lack the newline. The literal is searched
+// over the block at once and the line bounds are found around the hits only.
+// Returns false once the decoding should stop.
+
+bool Lib7ZipGrepOutStream::MatchLines(const char *data, size_t size) {
+    if (regexp)
+        return MatchRegexp(data, size);
+    const char *hay = data;
+    if (flags & GREP_NOCASE) {
+        lowered.assign(data, size);
+        std::transform(lowered.begin(), lowered.end(), lowered.begin(), ::tolower);
+        hay = lowered.data();
+    }
+    size_t pos = 0;
+    size_t counted = 0;
+    while (pos < size) {
+        const char *hit = Mem_Find(hay + pos, size - pos, literal.data(), literal.size());
+        if (!hit)
+            break;
+        size_t begin = (size_t)(hit - hay);
+        while (begin > pos && data[begin - 1] != '\n')
+            begin--;
+        const char *nl = (const char *)memchr(data + begin, '\n', size - begin);
+        size_t end = nl ? (size_t)(nl - data) : size;
+        line += std::count(data + counted, data + begin, '\n');
+        counted = begin;
+        AddMatch(data + begin, end - begin, line, offset + begin);
+        if (stopped)
+            return false;
+        pos = end + 1;
+    }
+    line += std::count(data + counted, data + size, '\n');
+    offset += size;
+    return true;
+}
+
+bool Lib7ZipGrepOutStream::MatchRegexp(const char *data, size_t size) {
+    size_t begin = 0;
+    while (begin < size) {
+        const char *nl = (const char *)memchr(data + begin, '\n', size - begin);
+        size_t end = nl ? (size_t)(nl - data) : size;
+        size_t length = end - begin;
+        if (length > 0 && data[end - 1] == '\r')
+            length--;
+        Tcl_SetStringObj(lineObj, data + begin, (Tcl_Size)length);
+        int match = Tcl_RegExpExecObj(tclInterp, regexp, lineObj, 0, 0, 0);
+        if (match < 0) {
+            failed = true;
+            return false;
+        }
+        if (match > 0) {
+            AddMatch(data + begin, end - begin, line, offset + begin);
+            if (stopped)
+                return false;
+        }
+        if (nl)
+            line++;
+        begin = end + 1;
+    }
+    offset += size;
+    return true;
+}
+
+void Lib7ZipGrepOutStream::AddMatch(const char *text, size_t length, UInt64 lineno, UInt64 position) {
+    found++;
+    // NOTE: the presence check needs no more data of the item
+    if (flags & GREP_FIRST) {
+        stopped = true;
+        return;
+    }
+    if (length > 0 && text[length - 1] == '\r')
+        length--;
+    Tcl_Obj *match = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, match, item);
+    Tcl_ListObjAppendElement(NULL, match, Tcl_NewWideIntObj((Tcl_WideInt)lineno));
+    Tcl_ListObjAppendElement(NULL, match, Tcl_NewWideIntObj((Tcl_WideInt)position));
+    Tcl_ListObjAppendElement(NULL, match, Tcl_NewStringObj(text, (Tcl_Size)length));
+    Tcl_ListObjAppendElement(NULL, matches, match);
+}
+
+static const char *Mem_Find(const char *hay, size_t size, const char *needle, size_t length) {
+    if (length == 0)
+        return hay;
+    // NOTE: memchr for the first byte runs on the vectorized libc code, memcmp confirms
+    while (size >= length) {
+        const char *p = (const char *)memchr(hay, needle[0], size - length + 1);
+        if (!p)
+            return NULL;
+        if (memcmp(p + 1, needle + 1, length - 1) == 0)
+            return p;
+        size -= (size_t)(p + 1 - hay);
+        hay = p + 1;
+    }
+    return NULL;
+}
+
+static const char *Mem_LastNewline(const char *data, size_t size) {
+    while (size > 0) {
+        if (data[--size] == '\n')
+            return data + size;
+    }
+    return NULL;
+}
@@ -0,0 +1,63 @@
+#ifndef LIB7ZIPGREP_H
+#define LIB7ZIPGREP_H
+
+#include <string>
+#include <lib7zip.h>
+#include <tcl.h>
+
+#include "lib7zipstream.hpp"
+
+// Output stream searching the decoded data line by line, nothing is kept
+// but the unfinished last line. Matches are appended as {item line offset text}.
+
+class Lib7ZipGrepOutStream:  public C7ZipOutStream {
+
+public:
+
+    enum {
+        GREP_NOCASE = 1 << 0,
+        GREP_REGEXP = 1 << 1,
+        GREP_FIRST = 1 << 2
+    };
+
+    Lib7ZipGrepOutStream(Tcl_Interp *interp, Tcl_Obj *pattern, int flags);
+
+    virtual ~Lib7ZipGrepOutStream();
+
+    virtual int Write(const void *data, unsigned int size, unsigned int *processedSize);
+    virtual int Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition);
+    virtual int SetSize(UInt64 size);
+
+    void Start(Tcl_Obj *item, Tcl_Obj *matches);
+    int Finish();
+    void SetCancel(Lib7ZipCancel *c) {cancel = c;};
+    bool Valid() {return !(flags & GREP_REGEXP) || regexp;};
+    bool Stopped() {return stopped;};
+    bool Failed() {return failed;};
+    UInt64 Found() {return found;};
+
+private:
+
+    Tcl_Interp *tclInterp;
+    Tcl_Obj *pattern;
+    int flags;
+    std::string literal;
+    Tcl_RegExp regexp;
+    Tcl_Obj *lineObj;
+    Tcl_Obj *item;
+    Tcl_Obj *matches;
+    std::string pending;
+    std::string lowered;
+    UInt64 offset;
+    UInt64 line;
+    UInt64 found;
+    bool stopped;
+    bool failed;
+    Lib7ZipCancel *cancel;
+
+    bool MatchLines(const char *data, size_t size);
+    bool MatchRegexp(const char *data, size_t size);
+    void AddMatch(const char *text, size_t length, UInt64 lineno, UInt64 position);
+};
+
+#endif
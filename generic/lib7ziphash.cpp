@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <string.h>
+#include "lib7ziphash.hpp"
+
+// CRC-32 (IEEE 802.3, reflected) processed eight bytes per step with
+// eight lookup tables (slicing-by-8).
+
+// NOTE: built by a static constructor when the library loads, before any worker thread
+static struct Crc32Tables {
+    uint32_t table[8][256];
+    Crc32Tables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : (c >> 1);
+            table[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++)
+            for (int t = 1; t < 8; t++)
+                table[t][i] = (table[t-1][i] >> 8) ^ table[0][table[t-1][i] & 0xFF];
+    }
+} crcTables;
+
+#define crcTable crcTables.table
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// XXH3 64-bit with seed 0 and the default secret, the input is taken as
+// 64 byte stripes of eight lanes, 16 stripes per block between scrambles.
+
+static const unsigned char xxhSecret[XXH3_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_PRIME_MX1 0x165667919E3779F9ULL
+#define XXH_PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define XXH_STRIPE_LEN 64
+#define XXH_STRIPES_PER_BLOCK ((XXH3_SECRET_SIZE - XXH_STRIPE_LEN) / 8)
+#define XXH_LAST_STRIPE_SECRET (XXH3_SECRET_SIZE - XXH_STRIPE_LEN - 7)
+
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static inline uint32_t Xxh_Read32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t Xxh_Read64(const unsigned char *p) {
+    return (uint64_t)Xxh_Read32(p) | ((uint64_t)Xxh_Read32(p + 4) << 32);
+}
+
+static inline uint64_t Xxh_Swap64(uint64_t x) {
+    x = ((x << 8) & 0xFF00FF00FF00FF00ULL) | ((x >> 8) & 0x00FF00FF00FF00FFULL);
+    x = ((x << 16) & 0xFFFF0000FFFF0000ULL) | ((x >> 16) & 0x0000FFFF0000FFFFULL);
+    return (x << 32) | (x >> 32);
+}
+
+// 64x64 to 128 bit product, the halves folded by xor
+static inline uint64_t Xxh_Mul128Fold64(uint64_t a, uint64_t b) {
+    uint64_t lolo = (a & 0xFFFFFFFFU) * (b & 0xFFFFFFFFU);
+    uint64_t hilo = (a >> 32) * (b & 0xFFFFFFFFU);
+    uint64_t lohi = (a & 0xFFFFFFFFU) * (b >> 32);
+    uint64_t hihi = (a >> 32) * (b >> 32);
+    uint64_t cross = (lolo >> 32) + (hilo & 0xFFFFFFFFU) + lohi;
+    uint64_t hi = (hilo >> 32) + (cross >> 32) + hihi;
+    uint64_t lo = (cross << 32) | (lolo & 0xFFFFFFFFU);
+    return lo ^ hi;
+}
+
+static inline uint64_t Xxh_Avalanche64(uint64_t h) {
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    return h ^ (h >> 32);
+}
+
+static inline uint64_t Xxh_Avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= XXH_PRIME_MX1;
+    return h ^ (h >> 32);
+}
+
+static inline uint64_t Xxh_Mix16(const unsigned char *p, const unsigned char *secret) {
+    return Xxh_Mul128Fold64(Xxh_Read64(p) ^ Xxh_Read64(secret), Xxh_Read64(p + 8) ^ Xxh_Read64(secret + 8));
+}
+
+static uint64_t Xxh3_Short(const unsigned char *p, size_t len) {
+    const unsigned char *secret = xxhSecret;
+    if (len == 0)
+        return Xxh_Avalanche64(Xxh_Read64(secret + 56) ^ Xxh_Read64(secret + 64));
+    if (len <= 3) {
+        uint32_t combined = ((uint32_t)p[0] << 16) | ((uint32_t)p[len >> 1] << 24) | p[len - 1] | ((uint32_t)len << 8);
+        return Xxh_Avalanche64(combined ^ (uint64_t)(Xxh_Read32(secret) ^ Xxh_Read32(secret + 4)));
+    }
+    if (len <= 8) {
+        uint64_t keyed = (Xxh_Read32(p + len - 4) + ((uint64_t)Xxh_Read32(p) << 32)) ^
+            (Xxh_Read64(secret + 8) ^ Xxh_Read64(secret + 16));
+        keyed ^= ROTL64(keyed, 49) ^ ROTL64(keyed, 24);
+        keyed *= XXH_PRIME_MX2;
+        keyed ^= (keyed >> 35) + len;
+        keyed *= XXH_PRIME_MX2;
+        return keyed ^ (keyed >> 28);
+    }
+    if (len <= 16) {
+        uint64_t lo = Xxh_Read64(p) ^ (Xxh_Read64(secret + 24) ^ Xxh_Read64(secret + 32));
+        uint64_t hi = Xxh_Read64(p + len - 8) ^ (Xxh_Read64(secret + 40) ^ Xxh_Read64(secret + 48));
+        return Xxh_Avalanche(len + Xxh_Swap64(lo) + hi + Xxh_Mul128Fold64(lo, hi));
+    }
+    uint64_t acc = len * XXH_PRIME64_1;
+    if (len <= 128) {
+        if (len > 32) {
+            if (len > 64) {
+                if (len > 96) {
+                    acc += Xxh_Mix16(p + 48, secret + 96);
+                    acc += Xxh_Mix16(p + len - 64, secret + 112);
+                }
+                acc += Xxh_Mix16(p + 32, secret + 64);
+                acc += Xxh_Mix16(p + len - 48, secret + 80);
+            }
+            acc += Xxh_Mix16(p + 16, secret + 32);
+            acc += Xxh_Mix16(p + len - 32, secret + 48);
+        }
+        acc += Xxh_Mix16(p, secret);
+        acc += Xxh_Mix16(p + len - 16, secret + 16);
+        return Xxh_Avalanche(acc);
+    }
+    // up to XXH3_SHORT_MAX
+    for (size_t i = 0; i < 8; i++)
+        acc += Xxh_Mix16(p + 16 * i, secret + 16 * i);
+    acc = Xxh_Avalanche(acc);
+    for (size_t i = 8; i < len / 16; i++)
+        acc += Xxh_Mix16(p + 16 * i, secret + 16 * (i - 8) + 3);
+    acc += Xxh_Mix16(p + len - 16, secret + XXH3_SECRET_SIZE_MIN - 17);
+    return Xxh_Avalanche(acc);
+}
+
+// NOTE: the eight independent lanes are left to the compiler to vectorize
+static inline void Xxh3_Accumulate(uint64_t *acc, const unsigned char *p, const unsigned char *secret) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t value = Xxh_Read64(p + 8 * i);
+        uint64_t key = value ^ Xxh_Read64(secret + 8 * i);
+        acc[i ^ 1] += value;
+        acc[i] += (key & 0xFFFFFFFFU) * (key >> 32);
+    }
+}
+
+static inline void Xxh3_Scramble(uint64_t *acc, const unsigned char *secret) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= Xxh_Read64(secret + 8 * i);
+        acc[i] = a * XXH_PRIME32_1;
+    }
+}
+
+Lib7ZipHash::Lib7ZipHash(int algorithms): algorithms(algorithms), crc(0xFFFFFFFFU), length(0), used(0),
+        xxhLength(0), xxhUsed(0), xxhStripes(0) {
+    state[0] = 0x6a09e667; state[1] = 0xbb67ae85; state[2] = 0x3c6ef372; state[3] = 0xa54ff53a;
+    state[4] = 0x510e527f; state[5] = 0x9b05688c; state[6] = 0x1f83d9ab; state[7] = 0x5be0cd19;
+    xxhAcc[0] = XXH_PRIME32_3; xxhAcc[1] = XXH_PRIME64_1; xxhAcc[2] = XXH_PRIME64_2; xxhAcc[3] = XXH_PRIME64_3;
+    xxhAcc[4] = XXH_PRIME64_4; xxhAcc[5] = XXH_PRIME32_2; xxhAcc[6] = XXH_PRIME64_5; xxhAcc[7] = XXH_PRIME32_1;
+}
+
+void Lib7ZipHash::Update(const void *data, size_t size) {
+    if (algorithms & HASH_CRC32)
+        UpdateCrc32((const unsigned char *)data, size);
+    if (algorithms & HASH_SHA256)
+        UpdateSha256((const unsigned char *)data, size);
+    if (algorithms & HASH_XXH3)
+        UpdateXxh3((const unsigned char *)data, size);
+}
+
+void Lib7ZipHash::UpdateCrc32(const unsigned char *p, size_t size) {
+    uint32_t c = crc;
+    for (; size >= 8; p += 8, size -= 8) {
+        uint32_t lo = c ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+        uint32_t hi = (uint32_t)p[4] | ((uint32_t)p[5] << 8) | ((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 24);
+        c = crcTable[7][lo & 0xFF] ^ crcTable[6][(lo >> 8) & 0xFF] ^
+            crcTable[5][(lo >> 16) & 0xFF] ^ crcTable[4][lo >> 24] ^
+            crcTable[3][hi & 0xFF] ^ crcTable[2][(hi >> 8) & 0xFF] ^
+            crcTable[1][(hi >> 16) & 0xFF] ^ crcTable[0][hi >> 24];
+    }
+    for (; size > 0; p++, size--)
+        c = crcTable[0][(c ^ *p) & 0xFF] ^ (c >> 8);
+    crc = c;
+}
+
+void Lib7ZipHash::UpdateSha256(const unsigned char *p, size_t size) {
+    length += size;
+    if (used > 0) {
+        size_t n = 64 - used < size ? 64 - used : size;
+        memcpy(block + used, p, n);
+        used += n;
+        p += n;
+        size -= n;
+        if (used < 64)
+            return;
+        TransformSha256(state, block);
+        used = 0;
+    }
+    for (; size >= 64; p += 64, size -= 64)
+        TransformSha256(state, p);
+    if (size > 0) {
+        memcpy(block, p, size);
+        used = size;
+    }
+}
+
+void Lib7ZipHash::ConsumeXxh3(uint64_t *acc, size_t *stripes, const unsigned char *p, size_t count) {
+    for (; count > 0; p += XXH_STRIPE_LEN, count--) {
+        Xxh3_Accumulate(acc, p, xxhSecret + 8 * *stripes);
+        if (++*stripes == XXH_STRIPES_PER_BLOCK) {
+            Xxh3_Scramble(acc, xxhSecret + XXH3_SECRET_SIZE - XXH_STRIPE_LEN);
+            *stripes = 0;
+        }
+    }
+}
+
+void Lib7ZipHash::UpdateXxh3(const unsigned char *p, size_t size) {
+    // NOTE: a stripe is consumed only when more input follows it,
+    // the last one is mixed in with its own secret by the digest
+    xxhLength += size;
+    if (size <= XXH3_BUFFER_SIZE - xxhUsed) {
+        memcpy(xxhBuffer + xxhUsed, p, size);
+        xxhUsed += size;
+        return;
+    }
+    if (xxhUsed > 0) {
+        size_t n = XXH3_BUFFER_SIZE - xxhUsed;
+        memcpy(xxhBuffer + xxhUsed, p, n);
+        p += n;
+        size -= n;
+        ConsumeXxh3(xxhAcc, &xxhStripes, xxhBuffer, XXH3_BUFFER_SIZE / XXH_STRIPE_LEN);
+        xxhUsed = 0;
+    }
+    if (size > XXH3_BUFFER_SIZE) {
+        size_t count = (size - 1) / XXH_STRIPE_LEN;
+        ConsumeXxh3(xxhAcc, &xxhStripes, p, count);
+        p += count * XXH_STRIPE_LEN;
+        size -= count * XXH_STRIPE_LEN;
+        // keep the tail of the consumed input for a last stripe shorter than the buffer
+        memcpy(xxhBuffer + XXH3_BUFFER_SIZE - XXH_STRIPE_LEN, p - XXH_STRIPE_LEN, XXH_STRIPE_LEN);
+    }
+    memcpy(xxhBuffer, p, size);
+    xxhUsed = size;
+}
+
+void Lib7ZipHash::TransformSha256(uint32_t *state, const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = ((uint32_t)p[i*4] << 24) | ((uint32_t)p[i*4+1] << 16) | ((uint32_t)p[i*4+2] << 8) | p[i*4+3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i-15], 7) ^ ROTR32(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = ROTR32(w[i-2], 17) ^ ROTR32(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+std::string Lib7ZipHash::Crc32() const {
+    char hex[9];
+    snprintf(hex, sizeof(hex), "%08x", crc ^ 0xFFFFFFFFU);
+    return hex;
+}
+
+std::string Lib7ZipHash::Xxh3() const {
+    uint64_t h;
+    if (xxhLength <= XXH3_SHORT_MAX) {
+        h = Xxh3_Short(xxhBuffer, (size_t)xxhLength);
+    } else {
+        // finalize a copy, as for the other digests
+        uint64_t acc[8];
+        size_t stripes = xxhStripes;
+        memcpy(acc, xxhAcc, sizeof(acc));
+        unsigned char last[XXH_STRIPE_LEN];
+        if (xxhUsed >= XXH_STRIPE_LEN) {
+            ConsumeXxh3(acc, &stripes, xxhBuffer, (xxhUsed - 1) / XXH_STRIPE_LEN);
+            memcpy(last, xxhBuffer + xxhUsed - XXH_STRIPE_LEN, XXH_STRIPE_LEN);
+        } else {
+            size_t catchup = XXH_STRIPE_LEN - xxhUsed;
+            memcpy(last, xxhBuffer + XXH3_BUFFER_SIZE - catchup, catchup);
+            memcpy(last + catchup, xxhBuffer, xxhUsed);
+        }
+        Xxh3_Accumulate(acc, last, xxhSecret + XXH_LAST_STRIPE_SECRET);
+        h = xxhLength * XXH_PRIME64_1;
+        for (int i = 0; i < 4; i++)
+            h += Xxh_Mul128Fold64(acc[2 * i] ^ Xxh_Read64(xxhSecret + 11 + 16 * i),
+                acc[2 * i + 1] ^ Xxh_Read64(xxhSecret + 11 + 16 * i + 8));
+        h = Xxh_Avalanche(h);
+    }
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%08x%08x", (uint32_t)(h >> 32), (uint32_t)h);
+    return hex;
+}
+
+std::string Lib7ZipHash::Sha256() const {
+    // finalize a copy, so the digest may be taken at any moment
+    uint32_t digest[8];
+    unsigned char tail[128];
+    memcpy(digest, state, sizeof(digest));
+    memcpy(tail, block, used);
+    size_t n = used;
+    tail[n++] = 0x80;
+    size_t padded = n <= 56 ? 64 : 128;
+    memset(tail + n, 0, padded - n);
+    uint64_t bits = length * 8;
+    for (int i = 0; i < 8; i++)
+        tail[padded - 1 - i] = (unsigned char)(bits >> (i * 8));
+    TransformSha256(digest, tail);
+    if (padded == 128)
+        TransformSha256(digest, tail + 64);
+    char hex[65];
+    for (int i = 0; i < 8; i++)
+        snprintf(hex + i * 8, 9, "%08x", digest[i]);
+    return hex;
+}
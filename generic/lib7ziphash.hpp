@@ -0,0 +1,55 @@
+#ifndef LIB7ZIPHASH_H
+#define LIB7ZIPHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+// Incremental digests computed while the data passes through output streams.
+
+#define XXH3_SECRET_SIZE 192
+#define XXH3_SECRET_SIZE_MIN 136
+#define XXH3_SHORT_MAX 240
+#define XXH3_BUFFER_SIZE 256
+
+class Lib7ZipHash {
+
+public:
+
+    enum {
+        HASH_CRC32 = 1 << 0,
+        HASH_SHA256 = 1 << 1,
+        HASH_XXH3 = 1 << 2
+    };
+
+    Lib7ZipHash(int algorithms);
+
+    void Update(const void *data, size_t size);
+
+    int Algorithms() {return algorithms;};
+    std::string Crc32() const;
+    std::string Sha256() const;
+    std::string Xxh3() const;
+
+private:
+
+    int algorithms;
+    uint32_t crc;
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+    uint64_t xxhAcc[8];
+    uint64_t xxhLength;
+    unsigned char xxhBuffer[XXH3_BUFFER_SIZE];
+    size_t xxhUsed;
+    size_t xxhStripes;
+
+    void UpdateCrc32(const unsigned char *data, size_t size);
+    void UpdateSha256(const unsigned char *data, size_t size);
+    void UpdateXxh3(const unsigned char *data, size_t size);
+    static void TransformSha256(uint32_t *state, const unsigned char *block);
+    static void ConsumeXxh3(uint64_t *acc, size_t *stripes, const unsigned char *data, size_t count);
+};
+
+#endif
@@ -0,0 +1,134 @@
+#include "lib7ziplibrary.hpp"
+#include "lib7zipstream.hpp"
+
+#if defined(LIB7ZIPLIBRARY_DEBUG)
+#   include <iostream>
+#   define DEBUGLOG(_x_) (std::cerr << "DEBUG: " << _x_ << "\n")
+#else
+#   define DEBUGLOG(_x_)
+#endif
+
+TCL_DECLARE_MUTEX(sharedMutex)
+static Lib7ZipLibrary *sharedLibrary = NULL;
+static unsigned long handleCounter = 0;
+static std::map<std::string, Lib7ZipCancel *> cancelTokens;
+
+Lib7ZipLibrary *Lib7ZipLibrary::Acquire() {
+    Tcl_MutexLock(&sharedMutex);
+    if (sharedLibrary == NULL)
+        sharedLibrary = new Lib7ZipLibrary();
+    sharedLibrary->refCount++;
+    DEBUGLOG("Lib7ZipLibrary::Acquire " << sharedLibrary << " refs " << sharedLibrary->refCount);
+    Lib7ZipLibrary *library = sharedLibrary;
+    Tcl_MutexUnlock(&sharedMutex);
+    return library;
+}
+
+void Lib7ZipLibrary::Release(Lib7ZipLibrary *library) {
+    Tcl_MutexLock(&sharedMutex);
+    DEBUGLOG("Lib7ZipLibrary::Release " << library << " refs " << library->refCount);
+    if (--library->refCount == 0) {
+        if (library == sharedLibrary)
+            sharedLibrary = NULL;
+        delete library;
+    }
+    Tcl_MutexUnlock(&sharedMutex);
+}
+
+unsigned long Lib7ZipLibrary::NextHandle() {
+    Tcl_MutexLock(&sharedMutex);
+    unsigned long handle = handleCounter++;
+    Tcl_MutexUnlock(&sharedMutex);
+    return handle;
+}
+
+// NOTE: the tokens are found by handle name, so other threads can cancel
+// operations of the handles they don't own
+
+void Lib7ZipLibrary::RegisterCancel(const std::string &handle, Lib7ZipCancel *cancel) {
+    Tcl_MutexLock(&sharedMutex);
+    cancelTokens[handle] = cancel;
+    Tcl_MutexUnlock(&sharedMutex);
+}
+
+void Lib7ZipLibrary::UnregisterCancel(const std::string &handle) {
+    Tcl_MutexLock(&sharedMutex);
+    cancelTokens.erase(handle);
+    Tcl_MutexUnlock(&sharedMutex);
+}
+
+bool Lib7ZipLibrary::CancelHandle(const std::string &handle) {
+    Tcl_MutexLock(&sharedMutex);
+    std::map<std::string, Lib7ZipCancel *>::iterator it = cancelTokens.find(handle);
+    bool found = it != cancelTokens.end();
+    if (found)
+        it->second->Cancel();
+    Tcl_MutexUnlock(&sharedMutex);
+    return found;
+}
+
+Lib7ZipLibrary::~Lib7ZipLibrary() {
+    DEBUGLOG("~Lib7ZipLibrary");
+    if (lib.IsInitialized())
+        lib.Deinitialize();
+    Tcl_MutexFinalize(&mutex);
+}
+
+bool Lib7ZipLibrary::Initialize(const std::wstring &dll) {
+    Tcl_MutexLock(&mutex);
+    bool ok = false;
+    if (!lib.IsInitialized()) {
+        // NOTE: formats and codecs are enumerated once, the extensions are kept for all users
+        if (dll.empty() ? lib.Initialize() : lib.Initialize(dll.c_str())) {
+            path = dll;
+            exts.clear();
+            lib.GetSupportedExts(exts);
+            ok = true;
+        }
+    }
+    Tcl_MutexUnlock(&mutex);
+    return ok;
+}
+
+bool Lib7ZipLibrary::IsInitialized() {
+    Tcl_MutexLock(&mutex);
+    bool initialized = lib.IsInitialized();
+    Tcl_MutexUnlock(&mutex);
+    return initialized;
+}
+
+std::wstring Lib7ZipLibrary::Path() {
+    Tcl_MutexLock(&mutex);
+    std::wstring result = path;
+    Tcl_MutexUnlock(&mutex);
+    return result;
+}
+
+bool Lib7ZipLibrary::SupportedExts(WStringArray &result) {
+    Tcl_MutexLock(&mutex);
+    bool ok = lib.IsInitialized();
+    if (ok)
+        result = exts;
+    Tcl_MutexUnlock(&mutex);
+    return ok;
+}
+
+bool Lib7ZipLibrary::OpenArchive(C7ZipInStream *stream, C7ZipArchive **archive,
+        const std::wstring &password, bool detecttype, lib7zip::ErrorCodeEnum *error) {
+    Tcl_MutexLock(&mutex);
+    bool ok = lib.OpenArchive(stream, archive, password, detecttype);
+    if (error)
+        *error = ok ? lib7zip::LIB7ZIP_NO_ERROR : lib.GetLastError();
+    Tcl_MutexUnlock(&mutex);
+    return ok;
+}
+
+bool Lib7ZipLibrary::OpenMultiVolumeArchive(C7ZipMultiVolumes *volumes, C7ZipArchive **archive,
+        const std::wstring &password, bool detecttype, lib7zip::ErrorCodeEnum *error) {
+    Tcl_MutexLock(&mutex);
+    bool ok = lib.OpenMultiVolumeArchive(volumes, archive, password, detecttype);
+    if (error)
+        *error = ok ? lib7zip::LIB7ZIP_NO_ERROR : lib.GetLastError();
+    Tcl_MutexUnlock(&mutex);
+    return ok;
+}
@@ -0,0 +1,48 @@
+#ifndef LIB7ZIPLIBRARY_H
+#define LIB7ZIPLIBRARY_H
+
+#include <string>
+#include <map>
+#include <lib7zip.h>
+#include <tcl.h>
+
+class Lib7ZipCancel;
+
+// The 7z library loaded once per process and shared by all interpreters and threads.
+// lib7zip keeps the last error in the library object, so opening is serialized,
+// the opened archives are used independently.
+
+class Lib7ZipLibrary {
+
+public:
+
+    static Lib7ZipLibrary *Acquire();
+    static void Release(Lib7ZipLibrary *library);
+    static unsigned long NextHandle();
+    static void RegisterCancel(const std::string &handle, Lib7ZipCancel *cancel);
+    static void UnregisterCancel(const std::string &handle);
+    static bool CancelHandle(const std::string &handle);
+
+    bool Initialize(const std::wstring &path);
+    bool IsInitialized();
+    std::wstring Path();
+    bool SupportedExts(WStringArray &exts);
+
+    bool OpenArchive(C7ZipInStream *stream, C7ZipArchive **archive,
+        const std::wstring &password, bool detecttype, lib7zip::ErrorCodeEnum *error);
+    bool OpenMultiVolumeArchive(C7ZipMultiVolumes *volumes, C7ZipArchive **archive,
+        const std::wstring &password, bool detecttype, lib7zip::ErrorCodeEnum *error);
+
+private:
+
+    Lib7ZipLibrary(): lib(), path(), exts(), refCount(0), mutex(NULL) {};
+    ~Lib7ZipLibrary();
+
+    C7ZipLibrary lib;
+    std::wstring path;
+    WStringArray exts;
+    int refCount;
+    Tcl_Mutex mutex;
+};
+
+#endif
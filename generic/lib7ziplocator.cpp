@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <set>
+#include <vector>
+#include "lib7ziplocator.hpp"
+#include "lib7zipsignature.hpp"
+
+#if defined(LIB7ZIPLOCATOR_DEBUG)
+#   include <iostream>
+#   define DEBUGLOG(_x_) (std::cerr << "DEBUG: " << _x_ << "\n")
+#else
+#   define DEBUGLOG(_x_)
+#endif
+
+#define ZIP_EOCD_SIZE 22
+#define ZIP_COMMENT_MAX 0xFFFF
+#define ZIP_CDH_SIZE 46
+#define ZIP_LFH_SIZE 30
+#define ZIP64_LOCATOR_SIZE 20
+#define ZIP64_EOCD_SIZE 56
+#define TAR_PAX_MAX 0x100000
+
+static bool Tar_Locate(C7ZipInStream *stream, UInt64 size, Lib7ZipStoredItems &items);
+static bool Tar_List(C7ZipInStream *stream, UInt64 size, Lib7ZipListItems &items);
+static bool Zip_Locate(C7ZipInStream *stream, UInt64 size, Lib7ZipStoredItems *items, Lib7ZipChecksums *checksums);
+static bool Zip_List(C7ZipInStream *stream, UInt64 size, Lib7ZipListItems &items);
+static bool Zip_Directory(C7ZipInStream *stream, UInt64 size, UInt64 &base, std::vector<unsigned char> &cd,
+    UInt64 &cdSize, UInt64 &entries);
+static size_t Stream_ReadAt(C7ZipInStream *stream, UInt64 position, unsigned char *data, size_t size);
+static UInt64 Tar_Number(const unsigned char *field, size_t size);
+static UInt64 Time_UnixToFileTime(Int64 t);
+static UInt64 Time_DosToFileTime(uint32_t dostime);
+static UInt64 Le_Get64(const unsigned char *p);
+static uint32_t Le_Get32(const unsigned char *p);
+static unsigned Le_Get16(const unsigned char *p);
+
+bool Lib7ZipLocateStored(C7ZipInStream *stream, const std::string &type, Lib7ZipStoredItems &items) {
+    UInt64 size;
+    if (stream->GetSize(&size) != 0)
+        return false;
+    if (type == "tar")
+        return Tar_Locate(stream, size, items);
+    if (type == "zip")
+        return Zip_Locate(stream, size, &items, NULL);
+    return false;
+}
+
+bool Lib7ZipLocateChecksums(C7ZipInStream *stream, const std::string &type, Lib7ZipChecksums &checksums) {
+    UInt64 size;
+    if (stream->GetSize(&size) != 0)
+        return false;
+    if (type == "zip")
+        return Zip_Locate(stream, size, NULL, &checksums);
+    return false;
+}
+
+bool Lib7ZipLocateList(C7ZipInStream *stream, const std::string &type, Lib7ZipListItems &items) {
+    UInt64 size;
+    if (stream->GetSize(&size) != 0)
+        return false;
+    if (type == "tar")
+        return Tar_List(stream, size, items);
+    if (type == "zip")
+        return Zip_List(stream, size, items);
+    return false;
+}
+
+static bool Tar_Locate(C7ZipInStream *stream, UInt64 size, Lib7ZipStoredItems &items) {
+    unsigned char header[TAR_BLOCK_SIZE];
+    std::string longname;
+    std::set<std::string> duplicates;
+    UInt64 pos = 0;
+    while (pos + TAR_BLOCK_SIZE <= size) {
+        if (Stream_ReadAt(stream, pos, header, TAR_BLOCK_SIZE) != TAR_BLOCK_SIZE)
+            return false;
+        if (header[0] == 0)
+            break; // NOTE: end of archive marker
+        if (!Tar_IsHeader(header, TAR_BLOCK_SIZE))
+            return false;
+        UInt64 length = Tar_Number(header + 124, 12);
+        UInt64 data = pos + TAR_BLOCK_SIZE;
+        char type = (char)header[156];
+        if (type == 'L') {
+            // GNU long name of the next entry
+            if (length == 0 || length > 0x10000)
+                return false;
+            std::vector<unsigned char> name((size_t)length);
+            if (Stream_ReadAt(stream, data, &name[0], (size_t)length) != length)
+                return false;
+            longname.assign((const char *)&name[0], strnlen((const char *)&name[0], (size_t)length));
+        } else {
+            if (type == '0' || type == '\0' || type == '7') {
+                std::string path = longname;
+                if (path.empty()) {
+                    path.assign((const char *)header, strnlen((const char *)header, 100));
+                    if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != 0)
+                        path = std::string((const char *)header + 345, strnlen((const char *)header + 345, 155)) + "/" + path;
+                }
+                Lib7ZipStoredItem item = {data, length, 0, false};
+                if (!items.insert(std::make_pair(path, item)).second)
+                    duplicates.insert(path);
+            }
+            // NOTE: pax headers may rename entries, those just won't be found by name
+            longname.clear();
+        }
+        pos = data + (length + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    }
+    // NOTE: the items are found by path, the ones sharing it are left to the decoder
+    for (std::set<std::string>::iterator d = duplicates.begin(); d != duplicates.end(); d++)
+        items.erase(*d);
+    DEBUGLOG("Tar_Locate " << items.size() << " items");
+    return true;
+}
+
+static bool Tar_List(C7ZipInStream *stream, UInt64 size, Lib7ZipListItems &items) {
+    unsigned char header[TAR_BLOCK_SIZE];
+    std::string longname;
+    std::string paxpath;
+    UInt64 paxsize = 0;
+    bool haspaxsize = false;
+    UInt64 pos = 0;
+    while (pos + TAR_BLOCK_SIZE <= size) {
+        if (Stream_ReadAt(stream, pos, header, TAR_BLOCK_SIZE) != TAR_BLOCK_SIZE)
+            return false;
+        if (header[0] == 0)
+            break; // NOTE: end of archive marker
+        if (!Tar_IsHeader(header, TAR_BLOCK_SIZE))
+            return false;
+        UInt64 length = Tar_Number(header + 124, 12);
+        UInt64 data = pos + TAR_BLOCK_SIZE;
+        char type = (char)header[156];
+        if (type == 'L' || type == 'x') {
+            if (length > TAR_PAX_MAX)
+                return false;
+            std::vector<unsigned char> record((size_t)length + 1);
+            if (Stream_ReadAt(stream, data, &record[0], (size_t)length) != length)
+                return false;
+            if (type == 'L') {
+                // GNU long name of the next entry
+                longname.assign((const char *)&record[0], strnlen((const char *)&record[0], (size_t)length));
+            } else {
+                // pax records are "length key=value\n", only the path and the size matter here
+                size_t r = 0;
+                while (r < length) {
+                    size_t recordLength = 0;
+                    size_t k = r;
+                    while (k < length && record[k] >= '0' && record[k] <= '9')
+                        recordLength = recordLength * 10 + (record[k++] - '0');
+                    // NOTE: the length counts its own digits, the space and the newline
+                    if (recordLength < k - r + 2 || r + recordLength > length || k >= length || record[k] != ' ')
+                        break;
+                    std::string field((const char *)&record[k + 1], r + recordLength - k - 2);
+                    if (field.compare(0, 5, "path=") == 0) {
+                        paxpath = field.substr(5);
+                    } else if (field.compare(0, 5, "size=") == 0) {
+                        paxsize = strtoull(field.c_str() + 5, NULL, 10);
+                        haspaxsize = true;
+                    }
+                    r += recordLength;
+                }
+            }
+        } else if (type != 'g' && type != 'K') {
+            std::string path = !paxpath.empty() ? paxpath : longname;
+            if (path.empty()) {
+                path.assign((const char *)header, strnlen((const char *)header, 100));
+                if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != 0)
+                    path = std::string((const char *)header + 345, strnlen((const char *)header + 345, 155)) + "/" + path;
+            }
+            if (haspaxsize)
+                length = paxsize;
+            Lib7ZipListItem item;
+            item.isdir = type == '5' || (!path.empty() && path[path.size() - 1] == '/');
+            while (path.size() > 1 && path[path.size() - 1] == '/')
+                path.erase(path.size() - 1);
+            item.path = path;
+            item.encrypted = false;
+            item.size = item.isdir ? 0 : length;
+            item.packsize = item.isdir ? 0 : (length + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+            // NOTE: FILE_ATTRIBUTE_UNIX_EXTENSION with the mode in the high word, as 7-Zip reports it
+            item.attrib = (Tar_Number(header + 100, 8) << 16) | 0x8000 | (item.isdir ? 0x10 : 0);
+            item.mtime = Time_UnixToFileTime((Int64)Tar_Number(header + 136, 12));
+            items.push_back(item);
+            longname.clear();
+            paxpath.clear();
+            haspaxsize = false;
+        }
+        pos = data + (length + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    }
+    DEBUGLOG("Tar_List " << items.size() << " items");
+    return true;
+}
+
+static bool Zip_Locate(C7ZipInStream *stream, UInt64 size, Lib7ZipStoredItems *items, Lib7ZipChecksums *checksums) {
+    UInt64 base, cdSize, entries;
+    std::vector<unsigned char> cd;
+    if (!Zip_Directory(stream, size, base, cd, cdSize, entries))
+        return false;
+    std::set<std::string> names;
+    std::set<std::string> duplicates;
+    size_t p = 0;
+    for (UInt64 e = 0; e < entries; e++) {
+        if (p + ZIP_CDH_SIZE > cdSize || memcmp(&cd[p], "PK\x01\x02", 4) != 0)
+            return false;
+        unsigned flags = Le_Get16(&cd[p + 8]);
+        unsigned method = Le_Get16(&cd[p + 10]);
+        uint32_t crc = Le_Get32(&cd[p + 16]);
+        UInt64 packed = Le_Get32(&cd[p + 20]);
+        UInt64 unpacked = Le_Get32(&cd[p + 24]);
+        unsigned nameLength = Le_Get16(&cd[p + 28]);
+        unsigned extraLength = Le_Get16(&cd[p + 30]);
+        unsigned commentLength = Le_Get16(&cd[p + 32]);
+        UInt64 local = Le_Get32(&cd[p + 42]);
+        if (p + ZIP_CDH_SIZE + nameLength > cdSize)
+            return false;
+        std::string name((const char *)&cd[p + ZIP_CDH_SIZE], nameLength);
+        p += ZIP_CDH_SIZE + nameLength + extraLength + commentLength;
+        if (!names.insert(name).second)
+            duplicates.insert(name);
+
+        // not encrypted, with plain ascii or utf-8 name
+        if ((flags & 0x0001) || name.empty() || name[name.size() - 1] == '/')
+            continue;
+        bool ascii = true;
+        for (size_t c = 0; c < name.size() && ascii; c++)
+            ascii = (unsigned char)name[c] < 0x80;
+        if (!ascii && !(flags & 0x0800))
+            continue;
+        if (checksums) {
+            (*checksums)[name] = crc;
+            continue;
+        }
+        // stored, not zip64
+        if (method != 0 || packed != unpacked || packed == 0xFFFFFFFF || local == 0xFFFFFFFF)
+            continue;
+        unsigned char header[ZIP_LFH_SIZE];
+        if (Stream_ReadAt(stream, base + local, header, ZIP_LFH_SIZE) != ZIP_LFH_SIZE ||
+                memcmp(header, "PK\x03\x04", 4) != 0)
+            continue;
+        UInt64 data = base + local + ZIP_LFH_SIZE + Le_Get16(header + 26) + Le_Get16(header + 28);
+        if (data + packed > size)
+            continue;
+        Lib7ZipStoredItem item = {data, packed, crc, true};
+        (*items)[name] = item;
+    }
+    // NOTE: the items are found by path, the ones sharing it are left to the decoder
+    for (std::set<std::string>::iterator d = duplicates.begin(); d != duplicates.end(); d++) {
+        if (items)
+            items->erase(*d);
+        if (checksums)
+            checksums->erase(*d);
+    }
+    DEBUGLOG("Zip_Locate " << (items ? items->size() : checksums->size()) << " items");
+    return true;
+}
+
+static bool Zip_List(C7ZipInStream *stream, UInt64 size, Lib7ZipListItems &items) {
+    UInt64 base, cdSize, entries;
+    std::vector<unsigned char> cd;
+    if (!Zip_Directory(stream, size, base, cd, cdSize, entries))
+        return false;
+    size_t p = 0;
+    for (UInt64 e = 0; e < entries; e++) {
+        if (p + ZIP_CDH_SIZE > cdSize || memcmp(&cd[p], "PK\x01\x02", 4) != 0)
+            return false;
+        unsigned host = Le_Get16(&cd[p + 4]) >> 8;
+        unsigned flags = Le_Get16(&cd[p + 8]);
+        uint32_t dostime = Le_Get32(&cd[p + 12]);
+        UInt64 packed = Le_Get32(&cd[p + 20]);
+        UInt64 unpacked = Le_Get32(&cd[p + 24]);
+        unsigned nameLength = Le_Get16(&cd[p + 28]);
+        unsigned extraLength = Le_Get16(&cd[p + 30]);
+        unsigned commentLength = Le_Get16(&cd[p + 32]);
+        uint32_t external = Le_Get32(&cd[p + 38]);
+        if (p + ZIP_CDH_SIZE + nameLength + extraLength > cdSize)
+            return false;
+        std::string name((const char *)&cd[p + ZIP_CDH_SIZE], nameLength);
+        // NOTE: the names in the OEM code page need the 7z.so conversion
+        if (!(flags & 0x0800)) {
+            for (size_t c = 0; c < name.size(); c++)
+                if ((unsigned char)name[c] >= 0x80)
+                    return false;
+        }
+        UInt64 ntfsTime = 0;
+        UInt64 unixTime = 0;
+        const unsigned char *extra = &cd[p + ZIP_CDH_SIZE + nameLength];
+        for (unsigned x = 0; x + 4 <= extraLength; ) {
+            unsigned id = Le_Get16(extra + x);
+            unsigned length = Le_Get16(extra + x + 2);
+            const unsigned char *field = extra + x + 4;
+            if (x + 4 + length > extraLength)
+                break;
+            if (id == 0x0001) {
+                // zip64 sizes, present only for the fields saturated in the header
+                unsigned f = 0;
+                if (unpacked == 0xFFFFFFFF && f + 8 <= length) {
+                    unpacked = Le_Get64(field + f);
+                    f += 8;
+                }
+                if (packed == 0xFFFFFFFF && f + 8 <= length)
+                    packed = Le_Get64(field + f);
+            } else if (id == 0x000A && length >= 32 && Le_Get16(field + 4) == 1 && Le_Get16(field + 6) >= 24) {
+                ntfsTime = Le_Get64(field + 8);
+            } else if (id == 0x5455 && length >= 5 && (field[0] & 1)) {
+                unixTime = Time_UnixToFileTime((Int64)(int32_t)Le_Get32(field + 1));
+            }
+            x += 4 + length;
+        }
+        p += ZIP_CDH_SIZE + nameLength + extraLength + commentLength;
+
+        Lib7ZipListItem item;
+        item.isdir = (!name.empty() && name[name.size() - 1] == '/') || (host == 0 && (external & 0x10));
+        while (name.size() > 1 && name[name.size() - 1] == '/')
+            name.erase(name.size() - 1);
+        item.path = name;
+        item.encrypted = (flags & 0x0001) != 0;
+        item.size = item.isdir ? 0 : unpacked;
+        item.packsize = item.isdir ? 0 : packed;
+        item.attrib = external;
+        if (host == 3 && (external >> 16))
+            item.attrib |= 0x8000;
+        if (item.isdir)
+            item.attrib |= 0x10;
+        item.mtime = ntfsTime ? ntfsTime : unixTime ? unixTime : Time_DosToFileTime(dostime);
+        items.push_back(item);
+    }
+    DEBUGLOG("Zip_List " << items.size() << " items");
+    return true;
+}
+
+static bool Zip_Directory(C7ZipInStream *stream, UInt64 size, UInt64 &base, std::vector<unsigned char> &cd,
+        UInt64 &cdSize, UInt64 &entries) {
+    if (size < ZIP_EOCD_SIZE)
+        return false;
+    size_t tailSize = (size_t)(size < ZIP_EOCD_SIZE + ZIP_COMMENT_MAX ? size : ZIP_EOCD_SIZE + ZIP_COMMENT_MAX);
+    std::vector<unsigned char> tail(tailSize);
+    if (Stream_ReadAt(stream, size - tailSize, &tail[0], tailSize) != tailSize)
+        return false;
+    size_t eocd = tailSize - ZIP_EOCD_SIZE + 1;
+    do {
+        eocd--;
+        if (memcmp(&tail[eocd], "PK\x05\x06", 4) == 0)
+            break;
+    } while (eocd > 0);
+    if (memcmp(&tail[eocd], "PK\x05\x06", 4) != 0)
+        return false;
+    entries = Le_Get16(&tail[eocd + 10]);
+    cdSize = Le_Get32(&tail[eocd + 12]);
+    UInt64 cdOffset = Le_Get32(&tail[eocd + 16]);
+    UInt64 end = size - tailSize + eocd;
+    if (entries == 0xFFFF || cdSize == 0xFFFFFFFF || cdOffset == 0xFFFFFFFF) {
+        // zip64 end of central directory, its locator is just before the classic one
+        unsigned char locator[ZIP64_LOCATOR_SIZE];
+        unsigned char record[ZIP64_EOCD_SIZE];
+        if (end < ZIP64_LOCATOR_SIZE + ZIP64_EOCD_SIZE ||
+                Stream_ReadAt(stream, end - ZIP64_LOCATOR_SIZE, locator, ZIP64_LOCATOR_SIZE) != ZIP64_LOCATOR_SIZE ||
+                memcmp(locator, "PK\x06\x07", 4) != 0)
+            return false;
+        // NOTE: the recorded offset is wrong for sfx, the record usually precedes the locator then
+        UInt64 recordPos = Le_Get64(locator + 8);
+        if (Stream_ReadAt(stream, recordPos, record, ZIP64_EOCD_SIZE) != ZIP64_EOCD_SIZE ||
+                memcmp(record, "PK\x06\x06", 4) != 0) {
+            recordPos = end - ZIP64_LOCATOR_SIZE - ZIP64_EOCD_SIZE;
+            if (Stream_ReadAt(stream, recordPos, record, ZIP64_EOCD_SIZE) != ZIP64_EOCD_SIZE ||
+                    memcmp(record, "PK\x06\x06", 4) != 0)
+                return false;
+        }
+        entries = Le_Get64(record + 32);
+        cdSize = Le_Get64(record + 40);
+        cdOffset = Le_Get64(record + 48);
+        end = recordPos;
+    }
+    // sfx stubs shift all offsets by the size of the prefix
+    if (cdOffset > end || cdSize > end - cdOffset)
+        return false;
+    base = end - (cdOffset + cdSize);
+    cd.resize((size_t)cdSize + 1);
+    if (Stream_ReadAt(stream, base + cdOffset, &cd[0], (size_t)cdSize) != cdSize)
+        return false;
+    return true;
+}
+
+static size_t Stream_ReadAt(C7ZipInStream *stream, UInt64 position, unsigned char *data, size_t size) {
+    if (stream->Seek((__int64)position, SEEK_SET, NULL) != 0)
+        return 0;
+    size_t total = 0;
+    while (total < size) {
+        unsigned int processed = 0;
+        if (stream->Read(data + total, (unsigned int)(size - total), &processed) != 0 || processed == 0)
+            break;
+        total += processed;
+    }
+    return total;
+}
+
+static UInt64 Tar_Number(const unsigned char *field, size_t size) {
+    UInt64 value = 0;
+    if (field[0] & 0x80) {
+        // GNU base-256 for sizes over 8G
+        for (size_t i = 1; i < size; i++)
+            value = (value << 8) | field[i];
+        return value;
+    }
+    size_t i = 0;
+    while (i < size && field[i] == ' ')
+        i++;
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + (field[i] - '0');
+    return value;
+}
+
+static UInt64 Time_UnixToFileTime(Int64 t) {
+    return (UInt64)(t + 11644473600LL) * 10000000;
+}
+
+static UInt64 Time_DosToFileTime(uint32_t dostime) {
+    // NOTE: the DOS time is the local time of the packer, the way 7-Zip reads it too
+    struct tm t;
+    memset(&t, 0, sizeof(t));
+    t.tm_year = ((dostime >> 25) & 0x7F) + 80;
+    t.tm_mon = ((dostime >> 21) & 0x0F) - 1;
+    t.tm_mday = (dostime >> 16) & 0x1F;
+    t.tm_hour = (dostime >> 11) & 0x1F;
+    t.tm_min = (dostime >> 5) & 0x3F;
+    t.tm_sec = (dostime & 0x1F) * 2;
+    t.tm_isdst = -1;
+    time_t u = mktime(&t);
+    return u == (time_t)-1 ? 0 : Time_UnixToFileTime((Int64)u);
+}
+
+static UInt64 Le_Get64(const unsigned char *p) {
+    return (UInt64)Le_Get32(p) | ((UInt64)Le_Get32(p + 4) << 32);
+}
+
+static uint32_t Le_Get32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static unsigned Le_Get16(const unsigned char *p) {
+    return (unsigned)p[0] | ((unsigned)p[1] << 8);
+}
@@ -0,0 +1,47 @@
+#ifndef LIB7ZIPLOCATOR_H
+#define LIB7ZIPLOCATOR_H
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <lib7zip.h>
+
+// Byte ranges of the items kept uncompressed in zip and tar archives,
+// so their data can be copied from the archive file without decoding.
+
+typedef struct {
+    UInt64 offset;
+    UInt64 size;
+    uint32_t crc;
+    bool hascrc;
+} Lib7ZipStoredItem;
+
+typedef std::map<std::string, Lib7ZipStoredItem> Lib7ZipStoredItems;
+
+bool Lib7ZipLocateStored(C7ZipInStream *stream, const std::string &type, Lib7ZipStoredItems &items);
+
+// CRC32 of all the file items found in the zip central directory, whatever the method.
+
+typedef std::map<std::string, uint32_t> Lib7ZipChecksums;
+
+bool Lib7ZipLocateChecksums(C7ZipInStream *stream, const std::string &type, Lib7ZipChecksums &checksums);
+
+// The item list read from the zip central directory (zip64 too) or from the plain tar headers,
+// in the archive order. The times are FILETIME values like the ones lib7zip returns.
+
+typedef struct {
+    std::string path;
+    bool isdir;
+    bool encrypted;
+    UInt64 size;
+    UInt64 packsize;
+    UInt64 attrib;
+    UInt64 mtime;
+} Lib7ZipListItem;
+
+typedef std::vector<Lib7ZipListItem> Lib7ZipListItems;
+
+bool Lib7ZipLocateList(C7ZipInStream *stream, const std::string &type, Lib7ZipListItems &items);
+
+#endif
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "lib7zipsignature.hpp"
+
+#if defined(LIB7ZIPSIGNATURE_DEBUG)
+#   include <iostream>
+#   define DEBUGLOG(_x_) (std::cerr << "DEBUG: " << _x_ << "\n")
+#else
+#   define DEBUGLOG(_x_)
+#endif
+
+#define HEAD_SIZE 4096
+#define TAIL_SIZE 512
+#define SCAN_BUFFER_SIZE (1024 * 1024)
+
+// NOTE: lib7zip does not expose the handler signatures, so the table follows
+// the kSignature/kSignatureOffset values of the 7-Zip format handlers.
+// Negative offsets are counted from the end of the stream.
+
+struct Lib7ZipSignature {
+    const char *type;
+    long offset;
+    const char *magic;
+    size_t size;
+};
+
+#define SIGNATURE(_type_, _offset_, _magic_) {_type_, _offset_, _magic_, sizeof(_magic_) - 1}
+
+static const Lib7ZipSignature signatures[] = {
+    SIGNATURE("7z", 0, "7z\xBC\xAF\x27\x1C"),
+    SIGNATURE("rar", 0, "Rar!\x1A\x07\x01\x00"),
+    SIGNATURE("rar", 0, "Rar!\x1A\x07\x00"),
+    SIGNATURE("xz", 0, "\xFD" "7zXZ\x00"),
+    SIGNATURE("zip", 0, "PK\x03\x04"),
+    SIGNATURE("zip", 0, "PK\x05\x06"),
+    SIGNATURE("zip", 0, "PK\x07\x08"),
+    SIGNATURE("zip", -22, "PK\x05\x06"),
+    SIGNATURE("msi", 0, "\xD0\xCF\x11\xE0\xA1\xB1\x1A\xE1"),
+    SIGNATURE("wim", 0, "MSWIM\x00\x00\x00"),
+    SIGNATURE("cab", 0, "MSCF\x00\x00\x00\x00"),
+    SIGNATURE("ar", 0, "!<arch>\x0A"),
+    SIGNATURE("vhd", -512, "conectix"),
+    SIGNATURE("zst", 0, "\x28\xB5\x2F\xFD"),
+    SIGNATURE("rpm", 0, "\xED\xAB\xEE\xDB"),
+    SIGNATURE("chm", 0, "ITSF"),
+    SIGNATURE("xar", 0, "xar!"),
+    SIGNATURE("lz", 0, "LZIP"),
+    SIGNATURE("squashfs", 0, "hsqs"),
+    SIGNATURE("squashfs", 0, "sqsh"),
+    SIGNATURE("dmg", -512, "koly"),
+    SIGNATURE("elf", 0, "\x7F" "ELF"),
+    SIGNATURE("iso", 0x8001, "CD001"),
+    SIGNATURE("udf", 0x8001, "BEA01"),
+    SIGNATURE("tar", 257, "ustar"),
+    SIGNATURE("cpio", 0, "070701"),
+    SIGNATURE("cpio", 0, "070702"),
+    SIGNATURE("cpio", 0, "070707"),
+    SIGNATURE("gz", 0, "\x1F\x8B\x08"),
+    SIGNATURE("bz2", 0, "BZh"),
+    SIGNATURE("lzh", 2, "-lh"),
+    SIGNATURE("z", 0, "\x1F\x9D"),
+    SIGNATURE("arj", 0, "\x60\xEA"),
+    // NOTE: executables may carry sfx archives, try them last
+    SIGNATURE("exe", 0, "MZ")
+};
+
+struct Lib7ZipCandidate {
+    const char *type;
+    size_t weight;
+    size_t order;
+};
+
+static bool Candidate_Less(const Lib7ZipCandidate &a, const Lib7ZipCandidate &b) {
+    return a.weight != b.weight ? a.weight > b.weight : a.order < b.order;
+}
+
+static size_t Stream_Read(C7ZipInStream *stream, UInt64 position, unsigned char *data, size_t size) {
+    if (stream->Seek((__int64)position, SEEK_SET, NULL) != 0)
+        return 0;
+    size_t total = 0;
+    while (total < size) {
+        unsigned int processed = 0;
+        if (stream->Read(data + total, (unsigned int)(size - total), &processed) != 0 || processed == 0)
+            break;
+        total += processed;
+    }
+    return total;
+}
+
+bool Lib7ZipIdentify(C7ZipInStream *stream, std::vector<std::string> &types) {
+    UInt64 size;
+    if (stream->GetSize(&size) != 0)
+        return false;
+
+    // one read for the head and one for the tail, deeper magics are probed separately
+    unsigned char head[HEAD_SIZE];
+    unsigned char tail[TAIL_SIZE];
+    size_t headLength = Stream_Read(stream, 0, head, size < HEAD_SIZE ? (size_t)size : HEAD_SIZE);
+    size_t tailLength = 0;
+    if (size > HEAD_SIZE) {
+        tailLength = Stream_Read(stream, size - TAIL_SIZE, tail, TAIL_SIZE);
+    } else {
+        tailLength = headLength < TAIL_SIZE ? headLength : TAIL_SIZE;
+        memcpy(tail, head + headLength - tailLength, tailLength);
+    }
+    DEBUGLOG("Lib7ZipIdentify size " << size << " head " << headLength << " tail " << tailLength);
+
+    std::vector<Lib7ZipCandidate> candidates;
+    size_t count = sizeof(signatures) / sizeof(signatures[0]);
+    for (size_t i = 0; i < count; i++) {
+        const Lib7ZipSignature &s = signatures[i];
+        bool match = false;
+        if (s.offset < 0) {
+            size_t back = (size_t)(-s.offset);
+            match = back <= tailLength && memcmp(tail + tailLength - back, s.magic, s.size) == 0;
+        } else if ((size_t)s.offset + s.size <= headLength) {
+            match = memcmp(head + s.offset, s.magic, s.size) == 0;
+        } else if ((UInt64)s.offset + s.size <= size) {
+            unsigned char probe[16];
+            match = Stream_Read(stream, (UInt64)s.offset, probe, s.size) == s.size &&
+                memcmp(probe, s.magic, s.size) == 0;
+        }
+        if (match) {
+            Lib7ZipCandidate c = {s.type, s.size, i};
+            candidates.push_back(c);
+        }
+    }
+    // NOTE: v7 tar headers have no magic, a valid header checksum is stronger evidence anyway
+    if (Tar_IsHeader(head, headLength)) {
+        Lib7ZipCandidate c = {"tar", 16, count};
+        candidates.push_back(c);
+    }
+    stream->Seek(0, SEEK_SET, NULL);
+
+    std::sort(candidates.begin(), candidates.end(), Candidate_Less);
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (std::find(types.begin(), types.end(), candidates[i].type) == types.end())
+            types.push_back(candidates[i].type);
+    }
+    return true;
+}
+
+static bool Scan_Less(const Lib7ZipScanMatch &a, const Lib7ZipScanMatch &b) {
+    return a.offset < b.offset;
+}
+
+static UInt64 Scan_Le(const unsigned char *p, size_t size) {
+    UInt64 value = 0;
+    while (size-- > 0)
+        value = (value << 8) | p[size];
+    return value;
+}
+
+// Checks the candidate beyond its magic where that is cheap, and follows the chain
+// of zip local headers and tar headers, so the members are not reported one by one.
+
+static bool Scan_Verify(C7ZipInStream *stream, const char *type, UInt64 start, UInt64 &zipNext, UInt64 &tarNext) {
+    unsigned char header[TAR_BLOCK_SIZE];
+    if (strcmp(type, "tar") == 0) {
+        if (Stream_Read(stream, start, header, TAR_BLOCK_SIZE) != TAR_BLOCK_SIZE || !Tar_IsHeader(header, TAR_BLOCK_SIZE))
+            return false;
+        UInt64 length = 0;
+        for (int i = 124; i < 136 && header[i] >= '0' && header[i] <= '7'; i++)
+            length = length * 8 + (header[i] - '0');
+        bool member = start == tarNext;
+        tarNext = start + TAR_BLOCK_SIZE + (length + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+        return !member;
+    }
+    if (strcmp(type, "zip") == 0) {
+        if (Stream_Read(stream, start, header, 30) != 30)
+            return false;
+        bool member = start == zipNext;
+        // NOTE: the sizes follow the data with a data descriptor, the chain breaks there
+        zipNext = (Scan_Le(header + 6, 2) & 0x0008) ? ~(UInt64)0 :
+            start + 30 + Scan_Le(header + 26, 2) + Scan_Le(header + 28, 2) + Scan_Le(header + 18, 4);
+        return !member;
+    }
+    if (strcmp(type, "bz2") == 0) {
+        return Stream_Read(stream, start, header, 10) == 10 && header[3] >= '1' && header[3] <= '9' &&
+            (memcmp(header + 4, "1AY&SY", 6) == 0 || memcmp(header + 4, "\x17\x72\x45\x38\x50\x90", 6) == 0);
+    }
+    if (strcmp(type, "lzh") == 0) {
+        return Stream_Read(stream, start, header, 7) == 7 && header[6] == '-';
+    }
+    return true;
+}
+
+bool Lib7ZipScan(C7ZipInStream *stream, std::vector<Lib7ZipScanMatch> &matches) {
+    UInt64 size;
+    if (stream->GetSize(&size) != 0)
+        return false;
+
+    // NOTE: the short magics and the trailers make no sense at any offset, the zip
+    // end records neither, an archive starts with its first local header
+    std::vector<const Lib7ZipSignature *> table;
+    bool first[256] = {false};
+    size_t longest = 0;
+    size_t count = sizeof(signatures) / sizeof(signatures[0]);
+    for (size_t i = 0; i < count; i++) {
+        const Lib7ZipSignature &s = signatures[i];
+        if (s.offset < 0 || s.size < 3 || strcmp(s.type, "exe") == 0)
+            continue;
+        if (strcmp(s.type, "zip") == 0 && memcmp(s.magic, "PK\x03\x04", 4) != 0)
+            continue;
+        table.push_back(&s);
+        first[(unsigned char)s.magic[0]] = true;
+        if (s.size > longest)
+            longest = s.size;
+    }
+
+    std::vector<unsigned char> buffer(SCAN_BUFFER_SIZE + longest);
+    std::vector<size_t> hits;
+    UInt64 zipNext = ~(UInt64)0;
+    UInt64 tarNext = ~(UInt64)0;
+    for (UInt64 pos = 0; pos < size; pos += SCAN_BUFFER_SIZE) {
+        // the chunks overlap by the longest magic, the ones across the boundary are found once
+        UInt64 want = size - pos < SCAN_BUFFER_SIZE + longest - 1 ? size - pos : SCAN_BUFFER_SIZE + longest - 1;
+        size_t length = Stream_Read(stream, pos, &buffer[0], (size_t)want);
+        if (length < want)
+            return false;
+        size_t limit = length < SCAN_BUFFER_SIZE ? length : SCAN_BUFFER_SIZE;
+
+        // memchr is vectorized by the C library, one pass for each distinct first byte
+        hits.clear();
+        for (int b = 0; b < 256; b++) {
+            if (!first[b])
+                continue;
+            const unsigned char *p = &buffer[0];
+            const unsigned char *stop = p + limit;
+            while (p < stop && (p = (const unsigned char *)memchr(p, b, stop - p)) != NULL) {
+                hits.push_back(p - &buffer[0]);
+                p++;
+            }
+        }
+        std::sort(hits.begin(), hits.end());
+
+        for (size_t h = 0; h < hits.size(); h++) {
+            size_t at = hits[h];
+            for (size_t t = 0; t < table.size(); t++) {
+                const Lib7ZipSignature &s = *table[t];
+                if (buffer[at] != (unsigned char)s.magic[0] || at + s.size > length ||
+                        pos + at < (UInt64)s.offset || memcmp(&buffer[at], s.magic, s.size) != 0)
+                    continue;
+                UInt64 start = pos + at - s.offset;
+                if (!Scan_Verify(stream, s.type, start, zipNext, tarNext))
+                    continue;
+                Lib7ZipScanMatch match = {start, s.type};
+                matches.push_back(match);
+            }
+        }
+    }
+    std::stable_sort(matches.begin(), matches.end(), Scan_Less);
+    DEBUGLOG("Lib7ZipScan size " << size << ", " << matches.size() << " candidates");
+    stream->Seek(0, SEEK_SET, NULL);
+    return true;
+}
+
+bool Tar_IsHeader(const unsigned char *block, size_t size) {
+    // NOTE: v7 headers have no magic, so verify the header checksum
+    if (size < TAR_BLOCK_SIZE || block[0] == 0)
+        return false;
+    unsigned long stored = 0;
+    int i = 148;
+    while (i < 156 && block[i] == ' ')
+        i++;
+    for (; i < 156 && block[i] >= '0' && block[i] <= '7'; i++)
+        stored = stored * 8 + (block[i] - '0');
+    unsigned long sum = 0;
+    for (i = 0; i < TAR_BLOCK_SIZE; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : block[i];
+    return sum == stored;
+}
@@ -0,0 +1,28 @@
+#ifndef LIB7ZIPSIGNATURE_H
+#define LIB7ZIPSIGNATURE_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <lib7zip.h>
+
+#define TAR_BLOCK_SIZE 512
+
+// Archive type guess from the magic numbers at the head and the tail of a stream.
+// The types are returned most likely first, using the names 7z.so knows as extensions.
+
+bool Lib7ZipIdentify(C7ZipInStream *stream, std::vector<std::string> &types);
+
+// Candidate archives embedded anywhere in a stream, by the magic numbers found at any offset.
+// The members of a zip or tar found before are skipped, not reported as archives of their own.
+
+typedef struct {
+    UInt64 offset;
+    const char *type;
+} Lib7ZipScanMatch;
+
+bool Lib7ZipScan(C7ZipInStream *stream, std::vector<Lib7ZipScanMatch> &matches);
+
+bool Tar_IsHeader(const unsigned char *block, size_t size);
+
+#endif
@@ -1,5 +1,31 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+#   include <windows.h>
+#else
+#   include <sys/stat.h>
+#   include <stdint.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+#ifdef __linux__
+#   include <sys/sendfile.h>
+#   include <sys/ioctl.h>
+#   include <linux/fs.h>
+#endif
 #include "lib7zipstream.hpp"
 
+// NOTE: the native sink writes whole buffers, so the file is written at aligned offsets
+#define OUT_BUFFER_SIZE (1024 * 1024)
+// NOTE: the sparse sink skips zero blocks of the usual filesystem block size
+#define SPARSE_BLOCK_SIZE 4096
+// NOTE: the script reader cache holds this many blocks, the read-ahead doubles up to its quarter
+#define READER_CACHE_BLOCKS 64
+#define READER_READAHEAD_MAX (READER_CACHE_BLOCKS / 4)
+// NOTE: the input that can not seek is copied by chunks of this size
+#define SPOOL_CHUNK_SIZE (64 * 1024)
+
 #if defined(LIB7ZIPSTREAM_DEBUG)
 #   include <iostream>
 #   define DEBUGLOG(_x_) (std::cerr << "DEBUG: " << _x_ << "\n")
@@ -7,8 +33,62 @@
 #   define DEBUGLOG(_x_)
 #endif
 
-Lib7ZipInStream::Lib7ZipInStream(Tcl_Interp *interp, Tcl_Obj *file, Tcl_Obj *type, bool usechannel):
-        tclInterp(interp), tclChannel(NULL), closechannel(!usechannel), end(-1), name(L""), ext(L""), convert() {
+void Lib7ZipCancel::Start(Tcl_WideInt timeout) {
+    state = CANCEL_NONE;
+    owner = Tcl_GetCurrentThread();
+    deadline = 0;
+    if (timeout > 0) {
+        Tcl_Time now;
+        Tcl_GetTime(&now);
+        deadline = (Tcl_WideInt)now.sec * 1000 + now.usec / 1000 + timeout;
+    }
+}
+
+void Lib7ZipCancel::Cancel() {
+    state = CANCEL_REQUESTED;
+    // NOTE: wake the owner thread if it waits in the event loop
+    Tcl_ThreadAlert(owner);
+}
+
+int Lib7ZipCancel::Check() {
+    if (deadline > 0 && state.load() == CANCEL_NONE && Remaining() == 0) {
+        // NOTE: a cancel request from another thread wins over the timeout
+        int expected = CANCEL_NONE;
+        state.compare_exchange_strong(expected, CANCEL_TIMEOUT);
+    }
+    return state.load();
+}
+
+Tcl_WideInt Lib7ZipCancel::Remaining() {
+    if (deadline == 0)
+        return -1;
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    Tcl_WideInt rest = deadline - ((Tcl_WideInt)now.sec * 1000 + now.usec / 1000);
+    return rest > 0 ? rest : 0;
+}
+
+
+bool Lib7ZipCancel::SetError(Tcl_Interp *interp) {
+    switch (Check()) {
+    case CANCEL_REQUESTED:
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("operation cancelled", -1));
+        Tcl_SetErrorCode(interp, "SEVENZIP", "CANCELLED", NULL);
+        return true;
+    case CANCEL_TIMEOUT:
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("operation timed out", -1));
+        Tcl_SetErrorCode(interp, "SEVENZIP", "TIMEOUT", NULL);
+        return true;
+    }
+    return false;
+}
+
+
+Lib7ZipInStream::Lib7ZipInStream(Tcl_Interp *interp, Tcl_Obj *file, Tcl_Obj *type, bool usechannel,
+        Tcl_WideInt spool):
+        tclInterp(interp), tclChannel(NULL), closechannel(!usechannel), spooled(false), inmemory(false), memory(),
+        mempos(0), ranged(false), base(0), end(-1), released(false), releasedpos(0), owner(NULL), recent(), cancel(NULL),
+        name(L""), ext(L""), convert() {
     DEBUGLOG("Lib7ZipInStream to open " << Tcl_GetString(file) << " as chan " << usechannel);
     if (usechannel) {
         int mode;
@@ -28,23 +108,36 @@ Lib7ZipInStream::Lib7ZipInStream(Tcl_Interp *interp, Tcl_Obj *file, Tcl_Obj *typ
             return;
         }
     } else {
+        // NOTE: interp may be NULL when the stream is opened by a worker thread
         tclChannel = Tcl_FSOpenFileChannel(tclInterp, file, "rb", 0644);
         if (tclChannel == NULL) {
-            Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
-                "couldn't read file \"%s\": %s", Tcl_GetString(file), Tcl_PosixError(tclInterp)));
+            if (tclInterp)
+                Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                    "couldn't read file \"%s\": %s", Tcl_GetString(file), Tcl_PosixError(tclInterp)));
             return;
         }
     }
     {
         Tcl_WideInt pos = Tcl_Tell(tclChannel);
+        Tcl_WideInt size = -1;
         if (pos >= 0) {
-            end = Tcl_Seek(tclChannel, 0, SEEK_END);
-            if (end >= 0)
+            size = Tcl_Seek(tclChannel, 0, SEEK_END);
+            if (size >= 0)
                 pos = Tcl_Seek(tclChannel, pos, SEEK_SET);
         }
-        if (pos < 0 || end < 0) {
-            Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
-                "couldn't seek on \"%s\": %s", Tcl_GetString(file), Tcl_PosixError(tclInterp)));
+        if (size >= 0)
+            end = (UInt64)size;
+        if ((pos < 0 || size < 0) && spool >= 0) {
+            if (!Spool(file, spool)) {
+                if (closechannel && tclChannel)
+                    Tcl_Close(tclInterp, tclChannel);
+                tclChannel = NULL;
+                return;
+            }
+        } else if (pos < 0 || size < 0) {
+            if (tclInterp)
+                Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                    "couldn't seek on \"%s\": %s", Tcl_GetString(file), Tcl_PosixError(tclInterp)));
             if (closechannel)
                 Tcl_Close(tclInterp, tclChannel);
             tclChannel = NULL;
@@ -70,6 +163,18 @@ Lib7ZipInStream::Lib7ZipInStream(Tcl_Interp *interp, Tcl_Obj *file, Tcl_Obj *typ
     DEBUGLOG("Lib7ZipInStream ext size " << ext.size());
 }
 
+// Takes the data spooled by Lib7ZipSpoolOutStream, the temporary file if any or the memory otherwise.
+
+Lib7ZipInStream::Lib7ZipInStream(Tcl_Channel spool, std::vector<char> &data, UInt64 size, Tcl_Obj *type):
+        tclInterp(NULL), tclChannel(spool), closechannel(true), spooled(true), inmemory(!spool), memory(),
+        mempos(0), ranged(false), base(0), end(size), released(false), releasedpos(0), owner(NULL), recent(), cancel(NULL),
+        name(L""), ext(L""), convert() {
+    DEBUGLOG("Lib7ZipInStream spooled " << size << (inmemory ? " in memory" : " to file"));
+    memory.swap(data);
+    if (type)
+        ext = convert.from_bytes(Tcl_GetString(type)).c_str();
+}
+
 Lib7ZipInStream::~Lib7ZipInStream() {
     DEBUGLOG("~Lib7ZipInStream");
     if (tclChannel && closechannel)
@@ -78,7 +183,31 @@ Lib7ZipInStream::~Lib7ZipInStream() {
 
 int Lib7ZipInStream::Read(void *data, unsigned int size, unsigned int *processedSize) {
     DEBUGLOG("Lib7ZipInStream::Read " << size);
+    if (cancel && cancel->Check() != Lib7ZipCancel::CANCEL_NONE)
+        return 1;
+    if (owner && !owner->Touch(this))
+        return 1;
+    if (inmemory) {
+        unsigned int read = 0;
+        if (mempos < base + end) {
+            read = base + end - mempos < size ? (unsigned int)(base + end - mempos) : size;
+            memcpy(data, &memory[mempos], read);
+            mempos += read;
+        }
+        if (processedSize)
+            *processedSize = read;
+        return 0;
+    }
     if (tclChannel) {
+        if (ranged) {
+            // NOTE: the bytes past the range belong to the outer file
+            Tcl_WideInt pos = Tcl_Tell(tclChannel);
+            if (pos < (Tcl_WideInt)base)
+                return 1;
+            UInt64 rest = (UInt64)pos - base < end ? end - ((UInt64)pos - base) : 0;
+            if (size > rest)
+                size = (unsigned int)rest;
+        }
         Tcl_Size read = Tcl_Read(tclChannel, (char *)data, (Tcl_Size)size);
         if (read >= 0) {
             if (processedSize)
@@ -91,7 +220,39 @@ int Lib7ZipInStream::Read(void *data, unsigned int size, unsigned int *processed
 
 int Lib7ZipInStream::Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition) {
     DEBUGLOG("Lib7ZipInStream::Seek " << offset << " as " << seekOrigin);
-    if (tclChannel) {
+    if (owner && !owner->Touch(this))
+        return 1;
+    if (inmemory) {
+        __int64 target;
+        switch (seekOrigin) {
+        case SEEK_SET: target = (__int64)base + offset; break;
+        case SEEK_CUR: target = (__int64)mempos + offset; break;
+        case SEEK_END: target = (__int64)(base + end) + offset; break;
+        default: return 1;
+        }
+        if (target < (__int64)base)
+            return 1;
+        mempos = (UInt64)target;
+        if (newPosition)
+            *newPosition = mempos - base;
+        return 0;
+    } else if (tclChannel && ranged) {
+        Tcl_WideInt target;
+        switch (seekOrigin) {
+        case SEEK_SET: target = (Tcl_WideInt)base + offset; break;
+        case SEEK_CUR: target = Tcl_Tell(tclChannel) + offset; break;
+        case SEEK_END: target = (Tcl_WideInt)(base + end) + offset; break;
+        default: return 1;
+        }
+        if (target < (Tcl_WideInt)base)
+            return 1;
+        Tcl_WideInt pos = Tcl_Seek(tclChannel, target, SEEK_SET);
+        if (pos >= 0) {
+            if (newPosition)
+                *newPosition = pos - base;
+            return 0;
+        }
+    } else if (tclChannel) {
         Tcl_WideInt pos = Tcl_Seek(tclChannel, offset, seekOrigin);
         if (pos >= 0) {
             if (newPosition)
@@ -102,9 +263,166 @@ int Lib7ZipInStream::Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPo
     return 1;
 }
 
+// Narrows the stream to a byte range of the file, so an archive embedded at an offset
+// is opened in place. The handlers see the positions and the size relative to the range.
+
+bool Lib7ZipInStream::SetRange(UInt64 offset, UInt64 length) {
+    DEBUGLOG("Lib7ZipInStream::SetRange " << offset << " length " << length);
+    if (!Valid() || ranged || offset > end)
+        return false;
+    if (inmemory)
+        mempos = offset;
+    else if (Tcl_Seek(tclChannel, (Tcl_WideInt)offset, SEEK_SET) < 0)
+        return false;
+    base = offset;
+    end = end - offset < length ? end - offset : length;
+    ranged = true;
+    return true;
+}
+
+// Anonymous temporary file, removed by the system once closed.
+
+static Tcl_Channel Spool_TempChannel() {
+#ifdef _WIN32
+    char dir[MAX_PATH], path[MAX_PATH];
+    if (!GetTempPathA(MAX_PATH, dir) || !GetTempFileNameA(dir, "7zs", 0, path))
+        return NULL;
+    HANDLE handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+        return NULL;
+    return Tcl_MakeFileChannel((ClientData)handle, TCL_READABLE | TCL_WRITABLE);
+#else
+    const char *dir = getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp") + "/sevenzipXXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        Tcl_SetErrno(errno);
+        return NULL;
+    }
+    unlink(path.c_str());
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return Tcl_MakeFileChannel((ClientData)(intptr_t)fd, TCL_READABLE | TCL_WRITABLE);
+#endif
+}
+
+// Copies a channel that can not seek (a pipe, a socket) to its end, the stream reads the copy then.
+// The content is kept in memory up to the threshold and moved to an anonymous temporary file past it.
+// NOTE: 7-zip handlers want the size and random access, even for the formats written in one pass
+
+bool Lib7ZipInStream::Spool(Tcl_Obj *file, Tcl_WideInt threshold) {
+    DEBUGLOG("Lib7ZipInStream::Spool " << Tcl_GetString(file) << " up to " << threshold);
+    Tcl_Channel source = tclChannel;
+    Tcl_Channel temp = NULL;
+    // NOTE: the pipe is read to the end anyway, blocking spares waiting on the events
+    if (!closechannel && Tcl_SetChannelOption(tclInterp, source, "-blocking", "1") != TCL_OK)
+        return false;
+    std::vector<char> chunk(SPOOL_CHUNK_SIZE);
+    UInt64 total = 0;
+    bool ok = true;
+    while (ok) {
+        Tcl_Size read = Tcl_Read(source, &chunk[0], SPOOL_CHUNK_SIZE);
+        if (read < 0) {
+            if (tclInterp)
+                Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                    "error reading \"%s\": %s", Tcl_GetString(file), Tcl_PosixError(tclInterp)));
+            ok = false;
+            break;
+        }
+        if (read == 0)
+            break;
+        if (!temp && total + read > (UInt64)threshold) {
+            temp = Spool_TempChannel();
+            if (!temp && tclInterp)
+                Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                    "couldn't create temporary file: %s", Tcl_PosixError(tclInterp)));
+            if (!temp || Tcl_SetChannelOption(tclInterp, temp, "-translation", "binary") != TCL_OK ||
+                    (total > 0 && Tcl_Write(temp, &memory[0], (Tcl_Size)total) < 0)) {
+                ok = false;
+                break;
+            }
+            std::vector<char>().swap(memory);
+        }
+        if (temp) {
+            if (Tcl_Write(temp, &chunk[0], read) < 0) {
+                if (tclInterp)
+                    Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                        "error spooling \"%s\": %s", Tcl_GetString(file), Tcl_PosixError(tclInterp)));
+                ok = false;
+            }
+        } else {
+            memory.insert(memory.end(), chunk.begin(), chunk.begin() + read);
+        }
+        total += read;
+    }
+    if (!closechannel)
+        Tcl_SetChannelOption(NULL, source, "-blocking", "0");
+    if (ok && temp && Tcl_Seek(temp, 0, SEEK_SET) < 0)
+        ok = false;
+    if (!ok) {
+        if (temp)
+            Tcl_Close(NULL, temp);
+        std::vector<char>().swap(memory);
+        return false;
+    }
+    // NOTE: the channel given is left at its end, the file opened by name is not needed anymore
+    if (closechannel)
+        Tcl_Close(tclInterp, source);
+    spooled = true;
+    closechannel = true;
+    tclChannel = temp;
+    inmemory = !temp;
+    end = total;
+    DEBUGLOG("Lib7ZipInStream::Spool " << total << (inmemory ? " in memory" : " to file"));
+    return true;
+}
+
+// Closes the file of a stream opened by name, keeping its position for Reopen.
+
+bool Lib7ZipInStream::Release() {
+    DEBUGLOG("Lib7ZipInStream::Release " << tclChannel);
+    if (!tclChannel || !closechannel || spooled)
+        return false;
+    releasedpos = Tcl_Tell(tclChannel);
+    Tcl_Close(NULL, tclChannel);
+    tclChannel = NULL;
+    released = true;
+    return true;
+}
+
+bool Lib7ZipInStream::Reopen() {
+    DEBUGLOG("Lib7ZipInStream::Reopen at " << releasedpos);
+    if (!released)
+        return !!tclChannel;
+    Tcl_Obj *file = Tcl_NewStringObj(convert.to_bytes(name).c_str(), -1);
+    Tcl_IncrRefCount(file);
+    tclChannel = Tcl_FSOpenFileChannel(NULL, file, "rb", 0644);
+    Tcl_DecrRefCount(file);
+    if (!tclChannel)
+        return false;
+    if (releasedpos > 0 && Tcl_Seek(tclChannel, releasedpos, SEEK_SET) < 0) {
+        Tcl_Close(NULL, tclChannel);
+        tclChannel = NULL;
+        return false;
+    }
+    released = false;
+    return true;
+}
+
+int Lib7ZipInStream::NativeHandle() {
+#ifdef _WIN32
+    return -1;
+#else
+    ClientData handle;
+    if (!tclChannel || Tcl_GetChannelHandle(tclChannel, TCL_READABLE, &handle) != TCL_OK)
+        return -1;
+    return (int)(intptr_t)handle;
+#endif
+}
+
 int Lib7ZipInStream::GetSize(UInt64 *size) {
     DEBUGLOG("Lib7ZipInStream::GetSize => " << end);
-    if (tclChannel) {
+    if (Valid()) {
         if (size)
             *size = end;
         return 0;
@@ -114,7 +432,8 @@ int Lib7ZipInStream::GetSize(UInt64 *size) {
 
 
 Lib7ZipOutStream::Lib7ZipOutStream(Tcl_Interp *interp, Tcl_Obj *file, bool usechannel):
-        tclInterp(interp), tclChannel(NULL), closechannel(!usechannel), convert() {
+        tclInterp(interp), tclChannel(NULL), closechannel(!usechannel), fd(-1), buffer(NULL), used(0),
+        sparse(false), hole(0), position(-1), hash(NULL), highwater(0), cancel(NULL), convert() {
     DEBUGLOG("Lib7ZipOutStream to open " << Tcl_GetString(file) << " as chan " << usechannel);
     if (usechannel) {
         int mode;
@@ -134,6 +453,23 @@ Lib7ZipOutStream::Lib7ZipOutStream(Tcl_Interp *interp, Tcl_Obj *file, bool usech
             return;
         }
     } else {
+#ifndef _WIN32
+        // NOTE: files on the native filesystem bypass the channel buffers
+        const char *native = (const char *)Tcl_FSGetNativePath(file);
+        if (native) {
+            fd = open(native, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                Tcl_SetErrno(errno);
+                Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+                    "couldn't create file \"%s\": %s", Tcl_GetString(file), Tcl_PosixError(tclInterp)));
+                return;
+            }
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            buffer = (char *)ckalloc(OUT_BUFFER_SIZE);
+            DEBUGLOG("Lib7ZipOutStream was open native " << native);
+            return;
+        }
+#endif
         tclChannel = Tcl_FSOpenFileChannel(tclInterp, file, "wb", 0644);
         if (tclChannel == NULL) {
             Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
@@ -146,25 +482,195 @@ Lib7ZipOutStream::Lib7ZipOutStream(Tcl_Interp *interp, Tcl_Obj *file, bool usech
 
 Lib7ZipOutStream::~Lib7ZipOutStream() {
     DEBUGLOG("~Lib7ZipOutStream");
+    // NOTE: a stream not closed by Close has failed, the buffered data is dropped
     if (tclChannel && closechannel)
-        Tcl_Close(tclInterp, tclChannel);
+        Tcl_Close(NULL, tclChannel);
+#ifndef _WIN32
+    if (fd >= 0)
+        close(fd);
+#endif
+    if (buffer)
+        ckfree(buffer);
+}
+
+// Writes out the buffered data and the trailing hole, the output stays open
+// for the metadata. Returns 0 on success, the error is left in errno.
+
+int Lib7ZipOutStream::Finish() {
+    if (fd >= 0)
+        return Flush();
+    if (tclChannel && closechannel)
+        return Tcl_Flush(tclChannel) == TCL_OK ? 0 : 1;
+    return 0;
+}
+
+// Finishes and closes the output, so the write errors reported late by the
+// filesystem (ENOSPC, EDQUOT, EIO) fail the extraction. The channels given
+// by the caller are left open.
+
+int Lib7ZipOutStream::Close() {
+    DEBUGLOG("Lib7ZipOutStream::Close");
+    int result = Finish();
+    int error = result != 0 ? errno : 0;
+#ifndef _WIN32
+    if (fd >= 0) {
+        if (close(fd) != 0 && result == 0) {
+            error = errno;
+            result = 1;
+        }
+        fd = -1;
+    }
+#endif
+    if (tclChannel && closechannel) {
+        if (Tcl_Close(NULL, tclChannel) != TCL_OK && result == 0) {
+            error = Tcl_GetErrno();
+            result = 1;
+        }
+    }
+    tclChannel = NULL;
+    if (result != 0)
+        Tcl_SetErrno(error);
+    return result;
 }
 
 int Lib7ZipOutStream::Write(const void *data, unsigned int size, unsigned int *processedSize) {
     DEBUGLOG("Lib7ZipOutStream::Write " << size);
+    if (cancel && cancel->Check() != Lib7ZipCancel::CANCEL_NONE)
+        return 1;
+    if (fd >= 0) {
+        const char *bytes = (const char *)data;
+        size_t rest = size;
+        while (rest > 0) {
+            size_t part = rest;
+            if (sparse) {
+                // zero blocks become a pending hole, the next data seeks past it,
+                // the blocks are taken at the file offsets so the holes match the filesystem blocks
+                if (position < 0) {
+                    off_t at = lseek(fd, 0, SEEK_CUR);
+                    if (at < 0)
+                        return 1;
+                    position = (Tcl_WideInt)at + (Tcl_WideInt)used + (Tcl_WideInt)hole;
+                }
+                part = SPARSE_BLOCK_SIZE - (size_t)(position % SPARSE_BLOCK_SIZE);
+                if (part > rest)
+                    part = rest;
+                position += part;
+                if (part == SPARSE_BLOCK_SIZE && Block_IsZero(bytes, part)) {
+                    hole += part;
+                    bytes += part;
+                    rest -= part;
+                    continue;
+                }
+                if (hole > 0 && Flush() != 0)
+                    return 1;
+            }
+            // NOTE: large blocks go straight to the descriptor when nothing is buffered
+            if (used == 0 && part >= OUT_BUFFER_SIZE) {
+                size_t direct = part - part % OUT_BUFFER_SIZE;
+                if (WriteNative(bytes, direct) != 0)
+                    return 1;
+                bytes += direct;
+                rest -= direct;
+                part -= direct;
+            }
+            while (part > 0) {
+                size_t chunk = OUT_BUFFER_SIZE - used;
+                if (chunk > part)
+                    chunk = part;
+                memcpy(buffer + used, bytes, chunk);
+                used += chunk;
+                bytes += chunk;
+                rest -= chunk;
+                part -= chunk;
+                if (used == OUT_BUFFER_SIZE && Flush() != 0)
+                    return 1;
+            }
+        }
+        if (hash)
+            hash->Update(data, size);
+        if (processedSize)
+            *processedSize = size;
+        return 0;
+    }
     if (tclChannel) {
         Tcl_Size wrote = Tcl_Write(tclChannel, (char *)data, (Tcl_Size)size);
         if (wrote >= 0) {
+            if (hash)
+                hash->Update(data, (size_t)wrote);
             if (processedSize)
                 *processedSize = (unsigned int)wrote;
+            if (highwater > 0 && Tcl_OutputBuffered(tclChannel) > highwater)
+                return WaitWritable();
             return 0;
         }
     }
     return 1;
 }
 
+// Pauses the decoder while the non-blocking channel drains its queued output
+// below the half of the high-water mark, serving the event loop meanwhile.
+
+int Lib7ZipOutStream::WaitWritable() {
+    DEBUGLOG("Lib7ZipOutStream::WaitWritable " << Tcl_OutputBuffered(tclChannel));
+    int result = 0;
+    int ready = 0;
+    // NOTE: the script may close the channel from an event handler
+    Tcl_RegisterChannel(NULL, tclChannel);
+    Tcl_CreateChannelHandler(tclChannel, TCL_WRITABLE, OutputReady, &ready);
+    // NOTE: the timer only wakes the loop when the time budget is over
+    Tcl_TimerToken timer = NULL;
+    int expired = 0;
+    if (cancel && cancel->Remaining() >= 0)
+        timer = Tcl_CreateTimerHandler((int)cancel->Remaining(), TimeoutReady, &expired);
+    while (Tcl_OutputBuffered(tclChannel) > highwater / 2) {
+        ready = 0;
+        while (!ready && Tcl_IsChannelRegistered(tclInterp, tclChannel) &&
+                !(cancel && cancel->Check() != Lib7ZipCancel::CANCEL_NONE))
+            Tcl_DoOneEvent(TCL_ALL_EVENTS);
+        if (!ready || Tcl_Flush(tclChannel) != TCL_OK) {
+            result = 1;
+            break;
+        }
+    }
+    if (timer && !expired)
+        Tcl_DeleteTimerHandler(timer);
+    Tcl_DeleteChannelHandler(tclChannel, OutputReady, &ready);
+    if (!Tcl_IsChannelRegistered(tclInterp, tclChannel)) {
+        Tcl_UnregisterChannel(NULL, tclChannel);
+        tclChannel = NULL;
+        Tcl_SetObjResult(tclInterp, Tcl_NewStringObj("channel was closed during extraction", -1));
+        return 1;
+    }
+    Tcl_UnregisterChannel(NULL, tclChannel);
+    if (result != 0 && !(cancel && cancel->Check() != Lib7ZipCancel::CANCEL_NONE))
+        Tcl_SetObjResult(tclInterp, Tcl_ObjPrintf(
+            "error writing \"%s\": %s", Tcl_GetChannelName(tclChannel), Tcl_PosixError(tclInterp)));
+    return result;
+}
+
+void Lib7ZipOutStream::OutputReady(ClientData clientData, int mask) {
+    *(int *)clientData = 1;
+}
+
+void Lib7ZipOutStream::TimeoutReady(ClientData clientData) {
+    *(int *)clientData = 1;
+}
+
 int Lib7ZipOutStream::Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition) {
     DEBUGLOG("Lib7ZipOutStream::Seek " << offset << " as " << seekOrigin);
+#ifndef _WIN32
+    if (fd >= 0) {
+        if (Flush() != 0)
+            return 1;
+        off_t pos = lseek(fd, (off_t)offset, (int)seekOrigin);
+        if (pos < 0)
+            return 1;
+        position = (Tcl_WideInt)pos;
+        if (newPosition)
+            *newPosition = (UInt64)pos;
+        return 0;
+    }
+#endif
     if (tclChannel) {
         Tcl_WideInt pos = Tcl_Seek(tclChannel, offset, seekOrigin);
         if (pos >= 0) {
@@ -176,60 +682,657 @@ int Lib7ZipOutStream::Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newP
     return 1;
 }
 
+// Sets the final size of the output. The native sink reserves the blocks up front,
+// so the file is not fragmented by the growing writes, or only sets the length
+// in the sparse mode, leaving holes the zero blocks are skipped into.
+
 int Lib7ZipOutStream::SetSize(UInt64 size) {
-    Tcl_Panic("Lib7ZipOutStream::SetSize!");
-    return -1;
+    DEBUGLOG("Lib7ZipOutStream::SetSize " << size);
+#ifndef _WIN32
+    if (fd >= 0) {
+        if (Flush() != 0)
+            return 1;
+#ifdef __linux__
+        if (!sparse && fallocate(fd, 0, 0, (off_t)size) == 0)
+            return 0;
+        // NOTE: filesystems without fallocate just get the length
+#endif
+        return ftruncate(fd, (off_t)size) == 0 ? 0 : 1;
+    }
+#endif
+    if (tclChannel && Tcl_Flush(tclChannel) == TCL_OK && Tcl_TruncateChannel(tclChannel, (Tcl_WideInt)size) == TCL_OK)
+        return 0;
+    return 1;
+}
+
+// NOTE: file attributes are restored on the open descriptor, after flushing
+// the channel buffers, so closing the channel doesn't touch them again
+
+int Lib7ZipOutStream::SetMTime(UInt64 filetime) {
+    DEBUGLOG("Lib7ZipOutStream::SetMTime " << filetime);
+    ClientData handle;
+    if (fd >= 0) {
+        if (Flush() != 0)
+            return 1;
+        handle = (ClientData)(intptr_t)fd;
+    } else if (!tclChannel || Tcl_Flush(tclChannel) != TCL_OK ||
+            Tcl_GetChannelHandle(tclChannel, TCL_WRITABLE, &handle) != TCL_OK)
+        return 1;
+#ifdef _WIN32
+    FILETIME ft;
+    ft.dwLowDateTime = (DWORD)filetime;
+    ft.dwHighDateTime = (DWORD)(filetime >> 32);
+    return SetFileTime((HANDLE)handle, NULL, NULL, &ft) ? 0 : 1;
+#else
+    const UInt64 kUnixTimeOffset = 11644473600ULL;
+    const UInt64 kTicksPerSecond = 10000000ULL;
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_NOW;
+    times[1].tv_sec = (time_t)((Int64)(filetime / kTicksPerSecond) - (Int64)kUnixTimeOffset);
+    times[1].tv_nsec = (long)(filetime % kTicksPerSecond) * 100;
+    return futimens((int)(intptr_t)handle, times) == 0 ? 0 : 1;
+#endif
+}
+
+int Lib7ZipOutStream::SetMode(int mode) {
+    DEBUGLOG("Lib7ZipOutStream::SetMode " << mode);
+#ifdef _WIN32
+    return 0;
+#else
+    ClientData handle;
+    if (fd >= 0)
+        handle = (ClientData)(intptr_t)fd;
+    else if (!tclChannel || Tcl_GetChannelHandle(tclChannel, TCL_WRITABLE, &handle) != TCL_OK)
+        return 1;
+    return fchmod((int)(intptr_t)handle, (mode_t)mode) == 0 ? 0 : 1;
+#endif
+}
+
+// Copies a byte range of the source descriptor in the kernel, the data never
+// reaches user space. On failure the output is rewound, so the caller may decode instead.
+
+int Lib7ZipOutStream::CopyRange(int source, UInt64 offset, UInt64 size) {
+    DEBUGLOG("Lib7ZipOutStream::CopyRange " << source << " at " << offset << " size " << size);
+#ifdef __linux__
+    if (fd < 0 || source < 0 || hash || used != 0 || hole != 0)
+        return 1;
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (start < 0)
+        return 1;
+    position = -1;
+    loff_t from = (loff_t)offset;
+    UInt64 rest = size;
+    bool sendfallback = false;
+    while (rest > 0) {
+        size_t chunk = rest > 0x40000000 ? 0x40000000 : (size_t)rest;
+        ssize_t copied;
+        if (!sendfallback) {
+            copied = copy_file_range(source, &from, fd, NULL, chunk, 0);
+            if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                sendfallback = true;
+                continue;
+            }
+        } else {
+            off_t sendfrom = (off_t)from;
+            copied = sendfile(fd, source, &sendfrom, chunk);
+            if (copied > 0)
+                from = (loff_t)sendfrom;
+        }
+        if (copied < 0 && errno == EINTR)
+            continue;
+        if (copied <= 0) {
+            if (lseek(fd, start, SEEK_SET) >= 0 && ftruncate(fd, start) == 0)
+                return 1;
+            return -1;
+        }
+        rest -= (UInt64)copied;
+    }
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+// Makes the output a copy of a file written before, sharing its blocks where
+// the filesystem can (FICLONE), with a kernel copy otherwise. The result is as for CopyRange.
+
+int Lib7ZipOutStream::CloneFile(Tcl_Obj *source) {
+    DEBUGLOG("Lib7ZipOutStream::CloneFile " << Tcl_GetString(source));
+#ifdef __linux__
+    if (fd < 0 || hash || used != 0 || hole != 0 || lseek(fd, 0, SEEK_CUR) != 0)
+        return 1;
+    const char *native = (const char *)Tcl_FSGetNativePath(source);
+    int in = native ? open(native, O_RDONLY | O_CLOEXEC) : -1;
+    if (in < 0)
+        return 1;
+    int result = 1;
+    struct stat st;
+    if (fstat(in, &st) == 0) {
+#ifdef FICLONE
+        if (ioctl(fd, FICLONE, in) == 0)
+            result = 0;
+        else
+#endif
+        result = CopyRange(in, 0, (UInt64)st.st_size);
+    }
+    close(in);
+    return result;
+#else
+    return 1;
+#endif
+}
+
+int Lib7ZipOutStream::Flush() {
+    if (fd < 0)
+        return 0;
+    int result = 0;
+    if (used > 0) {
+        result = WriteNative(buffer, used);
+        used = 0;
+    }
+#ifndef _WIN32
+    if (hole > 0 && result == 0) {
+        // NOTE: a hole at the end must still count in the file length
+        off_t pos = lseek(fd, (off_t)hole, SEEK_CUR);
+        struct stat st;
+        if (pos < 0 || fstat(fd, &st) != 0 || (st.st_size < pos && ftruncate(fd, pos) != 0))
+            result = 1;
+        hole = 0;
+    }
+#endif
+    return result;
+}
+
+bool Lib7ZipOutStream::Block_IsZero(const char *data, size_t size) {
+    // NOTE: comparing the block with itself shifted by a byte runs on the vectorized libc memcmp
+    return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+int Lib7ZipOutStream::WriteNative(const char *data, size_t size) {
+#ifdef _WIN32
+    return 1;
+#else
+    while (size > 0) {
+        ssize_t wrote = write(fd, data, size);
+        if (wrote < 0 && errno == EINTR)
+            continue;
+        if (wrote <= 0)
+            return 1;
+        data += wrote;
+        size -= (size_t)wrote;
+    }
+    return 0;
+#endif
 }
 
 
-Lib7ZipMultiVolumes::Lib7ZipMultiVolumes(Tcl_Interp *interp, Tcl_Obj *path, Tcl_Obj *type):
-        tclInterp(interp), type(type), current(NULL), streams(), convert() {
-    DEBUGLOG("Lib7ZipMultiVolumes");
+Lib7ZipNullOutStream::Lib7ZipNullOutStream(): pos(0), size(0), cancel(NULL), hash(NULL) {
+    DEBUGLOG("Lib7ZipNullOutStream");
+}
+
+Lib7ZipNullOutStream::~Lib7ZipNullOutStream() {
+    DEBUGLOG("~Lib7ZipNullOutStream");
+}
+
+int Lib7ZipNullOutStream::Write(const void *data, unsigned int count, unsigned int *processedSize) {
+    if (cancel && cancel->Check() != Lib7ZipCancel::CANCEL_NONE)
+        return 1;
+    if (hash)
+        hash->Update(data, count);
+    pos += count;
+    if (pos > size)
+        size = pos;
+    if (processedSize)
+        *processedSize = count;
+    return 0;
+}
+
+int Lib7ZipNullOutStream::Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition) {
+    DEBUGLOG("Lib7ZipNullOutStream::Seek " << offset << " as " << seekOrigin);
+    __int64 base;
+    switch (seekOrigin) {
+    case SEEK_SET: base = 0; break;
+    case SEEK_CUR: base = (__int64)pos; break;
+    case SEEK_END: base = (__int64)size; break;
+    default: return 1;
+    }
+    if (base + offset < 0)
+        return 1;
+    pos = (UInt64)(base + offset);
+    if (newPosition)
+        *newPosition = pos;
+    return 0;
+}
+
+int Lib7ZipNullOutStream::SetSize(UInt64 newSize) {
+    return 0;
+}
+
+Lib7ZipDataInStream::Lib7ZipDataInStream(Tcl_Obj *data, Tcl_Obj *type):
+        data(data), pos(0), ext(L""), convert() {
+    DEBUGLOG("Lib7ZipDataInStream");
+    Tcl_IncrRefCount(data);
+    if (type)
+        ext = convert.from_bytes(Tcl_GetString(type)).c_str();
+}
+
+Lib7ZipDataInStream::~Lib7ZipDataInStream() {
+    DEBUGLOG("~Lib7ZipDataInStream");
+    Tcl_DecrRefCount(data);
+}
+
+int Lib7ZipDataInStream::Read(void *buffer, unsigned int size, unsigned int *processedSize) {
+    DEBUGLOG("Lib7ZipDataInStream::Read " << size);
+    // NOTE: fetch bytes on every call, the object may be shimmered meanwhile
+    Tcl_Size length;
+    unsigned char *bytes = Tcl_GetByteArrayFromObj(data, &length);
+    unsigned int read = 0;
+    if (pos < (UInt64)length) {
+        read = (UInt64)length - pos < size ? (unsigned int)((UInt64)length - pos) : size;
+        memcpy(buffer, bytes + pos, read);
+        pos += read;
+    }
+    if (processedSize)
+        *processedSize = read;
+    return 0;
+}
+
+int Lib7ZipDataInStream::Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition) {
+    DEBUGLOG("Lib7ZipDataInStream::Seek " << offset << " as " << seekOrigin);
+    Tcl_Size length;
+    Tcl_GetByteArrayFromObj(data, &length);
+    __int64 base;
+    switch (seekOrigin) {
+    case SEEK_SET: base = 0; break;
+    case SEEK_CUR: base = (__int64)pos; break;
+    case SEEK_END: base = (__int64)length; break;
+    default: return 1;
+    }
+    if (base + offset < 0)
+        return 1;
+    pos = (UInt64)(base + offset);
+    if (newPosition)
+        *newPosition = pos;
+    return 0;
+}
+
+int Lib7ZipDataInStream::GetSize(UInt64 *size) {
+    Tcl_Size length;
+    Tcl_GetByteArrayFromObj(data, &length);
+    DEBUGLOG("Lib7ZipDataInStream::GetSize => " << length);
+    if (size)
+        *size = (UInt64)length;
+    return 0;
+}
+
+
+Lib7ZipReaderInStream::Lib7ZipReaderInStream(Tcl_Interp *interp, Tcl_Obj *command, UInt64 size, Tcl_Obj *type,
+        size_t blocksize):
+        tclInterp(interp), command(command), error(NULL), pos(0), size(size), blocksize(blocksize), next(0), readahead(1),
+        blocks(), cached(), cancel(NULL), ext(L""), convert() {
+    DEBUGLOG("Lib7ZipReaderInStream " << Tcl_GetString(command) << " size " << size << " block " << blocksize);
+    Tcl_IncrRefCount(command);
+    if (type)
+        ext = convert.from_bytes(Tcl_GetString(type)).c_str();
+}
+
+Lib7ZipReaderInStream::~Lib7ZipReaderInStream() {
+    DEBUGLOG("~Lib7ZipReaderInStream");
+    for (std::list<Lib7ZipReaderBlock>::iterator b = blocks.begin(); b != blocks.end(); b++)
+        Tcl_DecrRefCount(b->data);
+    if (error)
+        Tcl_DecrRefCount(error);
+    Tcl_DecrRefCount(command);
+}
+
+int Lib7ZipReaderInStream::Read(void *data, unsigned int size, unsigned int *processedSize) {
+    DEBUGLOG("Lib7ZipReaderInStream::Read " << size << " at " << pos);
+    if (cancel && cancel->Check() != Lib7ZipCancel::CANCEL_NONE)
+        return 1;
+    unsigned int read = 0;
+    while (read < size && pos < this->size) {
+        const Lib7ZipReaderBlock *block = Block(pos / blocksize);
+        if (!block)
+            return 1;
+        size_t offset = (size_t)(pos % blocksize);
+        if (offset >= block->length)
+            break;
+        size_t part = block->length - offset;
+        if (part > size - read)
+            part = size - read;
+        memcpy((char *)data + read, Tcl_GetByteArrayFromObj(block->data, NULL) + block->offset + offset, part);
+        read += (unsigned int)part;
+        pos += part;
+    }
+    if (processedSize)
+        *processedSize = read;
+    return 0;
+}
+
+int Lib7ZipReaderInStream::Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition) {
+    DEBUGLOG("Lib7ZipReaderInStream::Seek " << offset << " as " << seekOrigin);
+    __int64 base;
+    switch (seekOrigin) {
+    case SEEK_SET: base = 0; break;
+    case SEEK_CUR: base = (__int64)pos; break;
+    case SEEK_END: base = (__int64)size; break;
+    default: return 1;
+    }
+    if (base + offset < 0)
+        return 1;
+    pos = (UInt64)(base + offset);
+    if (newPosition)
+        *newPosition = pos;
+    return 0;
+}
+
+int Lib7ZipReaderInStream::GetSize(UInt64 *size) {
+    DEBUGLOG("Lib7ZipReaderInStream::GetSize => " << this->size);
+    if (size)
+        *size = this->size;
+    return 0;
+}
+
+// Returns the cached block, fetching it on a miss. A miss right after the previous fetch
+// doubles the read-ahead, any other one resets it, so a scan is served by few large reads.
+
+const Lib7ZipReaderInStream::Lib7ZipReaderBlock *Lib7ZipReaderInStream::Block(UInt64 block) {
+    std::map<UInt64, std::list<Lib7ZipReaderBlock>::iterator>::iterator found = cached.find(block);
+    if (found != cached.end()) {
+        blocks.splice(blocks.begin(), blocks, found->second);
+        return &*found->second;
+    }
+    if (block == next) {
+        if (readahead < READER_READAHEAD_MAX)
+            readahead *= 2;
+    } else {
+        readahead = 1;
+    }
+    UInt64 count = 1;
+    while (count < readahead && (block + count) * blocksize < size && cached.find(block + count) == cached.end())
+        count++;
+    if (!Fetch(block, count))
+        return NULL;
+    next = block + count;
+    found = cached.find(block);
+    return found != cached.end() ? &*found->second : NULL;
+}
+
+// Calls the command with the offset and the length of the blocks range, the result
+// is shared by the blocks it covers. Only the last block of the source may be short.
+
+bool Lib7ZipReaderInStream::Fetch(UInt64 block, UInt64 count) {
+    UInt64 offset = block * blocksize;
+    UInt64 length = count * blocksize;
+    if (length > size - offset)
+        length = size - offset;
+    DEBUGLOG("Lib7ZipReaderInStream::Fetch " << offset << " length " << length);
+    Tcl_Obj *script = Tcl_DuplicateObj(command);
+    Tcl_IncrRefCount(script);
+    if (Tcl_ListObjAppendElement(tclInterp, script, Tcl_NewWideIntObj((Tcl_WideInt)offset)) != TCL_OK ||
+            Tcl_ListObjAppendElement(tclInterp, script, Tcl_NewWideIntObj((Tcl_WideInt)length)) != TCL_OK) {
+        Tcl_DecrRefCount(script);
+        return false;
+    }
+    // NOTE: the result of the running command is not the business of the reader
+    Tcl_InterpState state = Tcl_SaveInterpState(tclInterp, TCL_OK);
+    int code = Tcl_EvalObjEx(tclInterp, script, TCL_EVAL_GLOBAL);
+    Tcl_DecrRefCount(script);
+    Tcl_Obj *data = Tcl_GetObjResult(tclInterp);
+    Tcl_IncrRefCount(data);
+    Tcl_RestoreInterpState(tclInterp, state);
+    Tcl_Size read = -1;
+    if (code == TCL_OK && (!Tcl_GetByteArrayFromObj(data, &read) || (UInt64)read != length)) {
+        Tcl_DecrRefCount(data);
+        data = Tcl_ObjPrintf("reader returned %" TCL_LL_MODIFIER "d bytes at offset %" TCL_LL_MODIFIER "d"
+            " instead of %" TCL_LL_MODIFIER "d", (Tcl_WideInt)read, (Tcl_WideInt)offset, (Tcl_WideInt)length);
+        Tcl_IncrRefCount(data);
+        code = TCL_ERROR;
+    }
+    if (code != TCL_OK) {
+        if (error)
+            Tcl_DecrRefCount(error);
+        error = data;
+        return false;
+    }
+    for (UInt64 b = 0; b < count && b * blocksize < length; b++) {
+        if (blocks.size() >= READER_CACHE_BLOCKS) {
+            cached.erase(blocks.back().block);
+            Tcl_DecrRefCount(blocks.back().data);
+            blocks.pop_back();
+        }
+        Lib7ZipReaderBlock entry;
+        entry.block = block + b;
+        entry.data = data;
+        entry.offset = (size_t)(b * blocksize);
+        entry.length = (size_t)(length - b * blocksize < blocksize ? length - b * blocksize : blocksize);
+        Tcl_IncrRefCount(data);
+        blocks.push_front(entry);
+        cached[entry.block] = blocks.begin();
+    }
+    Tcl_DecrRefCount(data);
+    return true;
+}
+
+
+Lib7ZipDataOutStream::Lib7ZipDataOutStream(UInt64 limit):
+        data(Tcl_NewByteArrayObj(NULL, 0)), pos(0), size(0), allocated(0), limit(limit), truncated(false), cancel(NULL) {
+    DEBUGLOG("Lib7ZipDataOutStream limit " << limit);
+    Tcl_IncrRefCount(data);
+}
+
+Lib7ZipDataOutStream::~Lib7ZipDataOutStream() {
+    DEBUGLOG("~Lib7ZipDataOutStream");
+    Tcl_DecrRefCount(data);
+}
+
+int Lib7ZipDataOutStream::Write(const void *buffer, unsigned int count, unsigned int *processedSize) {
+    DEBUGLOG("Lib7ZipDataOutStream::Write " << count);
+    if (cancel && cancel->Check() != Lib7ZipCancel::CANCEL_NONE)
+        return 1;
+    unsigned int wrote = count;
+    if (pos >= limit)
+        wrote = 0;
+    else if (limit - pos < count)
+        wrote = (unsigned int)(limit - pos);
+    if (wrote > 0) {
+        if (!Reserve(pos + wrote))
+            return 1;
+        unsigned char *bytes = Tcl_GetByteArrayFromObj(data, NULL);
+        if (pos > size)
+            memset(bytes + size, 0, pos - size);
+        memcpy(bytes + pos, buffer, wrote);
+        pos += wrote;
+        if (pos > size)
+            size = pos;
+    }
+    if (processedSize)
+        *processedSize = wrote;
+    if (wrote < count) {
+        // NOTE: a failed write is the only way to stop the decoder early
+        truncated = true;
+        return 1;
+    }
+    return 0;
+}
+
+int Lib7ZipDataOutStream::Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition) {
+    DEBUGLOG("Lib7ZipDataOutStream::Seek " << offset << " as " << seekOrigin);
+    __int64 base;
+    switch (seekOrigin) {
+    case SEEK_SET: base = 0; break;
+    case SEEK_CUR: base = (__int64)pos; break;
+    case SEEK_END: base = (__int64)size; break;
+    default: return 1;
+    }
+    if (base + offset < 0)
+        return 1;
+    pos = (UInt64)(base + offset);
+    if (newPosition)
+        *newPosition = pos;
+    return 0;
+}
+
+int Lib7ZipDataOutStream::SetSize(UInt64 newSize) {
+    DEBUGLOG("Lib7ZipDataOutStream::SetSize " << newSize);
+    if (!Reserve(newSize < limit ? newSize : limit))
+        return 1;
+    return 0;
+}
+
+Tcl_Obj *Lib7ZipDataOutStream::GetData() {
+    if (allocated != size) {
+        Tcl_SetByteArrayLength(data, (Tcl_Size)size);
+        allocated = size;
+    }
+    return data;
+}
+
+bool Lib7ZipDataOutStream::Reserve(UInt64 required) {
+    if (required <= allocated)
+        return true;
+    UInt64 grow = allocated < 65536 ? 65536 : allocated * 2;
+    if (grow < required)
+        grow = required;
+    if ((UInt64)(Tcl_Size)grow != grow || (Tcl_Size)grow < 0) {
+        grow = required;
+        if ((UInt64)(Tcl_Size)grow != grow || (Tcl_Size)grow < 0)
+            return false;
+    }
+    Tcl_SetByteArrayLength(data, (Tcl_Size)grow);
+    allocated = grow;
+    return true;
+}
+
+
+Lib7ZipSpoolOutStream::Lib7ZipSpoolOutStream(UInt64 threshold):
+        tclChannel(NULL), memory(), threshold(threshold), pos(0), size(0), cancel(NULL) {
+    DEBUGLOG("Lib7ZipSpoolOutStream threshold " << threshold);
+}
+
+Lib7ZipSpoolOutStream::~Lib7ZipSpoolOutStream() {
+    DEBUGLOG("~Lib7ZipSpoolOutStream");
+    if (tclChannel)
+        Tcl_Close(NULL, tclChannel);
+}
+
+int Lib7ZipSpoolOutStream::Write(const void *buffer, unsigned int count, unsigned int *processedSize) {
+    DEBUGLOG("Lib7ZipSpoolOutStream::Write " << count);
+    if (cancel && cancel->Check() != Lib7ZipCancel::CANCEL_NONE)
+        return 1;
+    if (!tclChannel && pos + count > threshold) {
+        tclChannel = Spool_TempChannel();
+        if (!tclChannel || Tcl_SetChannelOption(NULL, tclChannel, "-translation", "binary") != TCL_OK ||
+                (size > 0 && Tcl_Write(tclChannel, &memory[0], (Tcl_Size)size) < 0))
+            return 1;
+        std::vector<char>().swap(memory);
+        DEBUGLOG("Lib7ZipSpoolOutStream moved " << size << " to file");
+    }
+    if (tclChannel) {
+        if (Tcl_Seek(tclChannel, (Tcl_WideInt)pos, SEEK_SET) < 0 ||
+                Tcl_Write(tclChannel, (const char *)buffer, (Tcl_Size)count) < 0)
+            return 1;
+    } else {
+        if (pos + count > memory.size())
+            memory.resize(pos + count);
+        memcpy(&memory[pos], buffer, count);
+    }
+    pos += count;
+    if (pos > size)
+        size = pos;
+    if (processedSize)
+        *processedSize = count;
+    return 0;
+}
+
+int Lib7ZipSpoolOutStream::Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition) {
+    DEBUGLOG("Lib7ZipSpoolOutStream::Seek " << offset << " as " << seekOrigin);
+    __int64 base;
+    switch (seekOrigin) {
+    case SEEK_SET: base = 0; break;
+    case SEEK_CUR: base = (__int64)pos; break;
+    case SEEK_END: base = (__int64)size; break;
+    default: return 1;
+    }
+    if (base + offset < 0)
+        return 1;
+    // NOTE: the gap left by a seek past the end reads as zeros, the file and the vector fill it both
+    pos = (UInt64)(base + offset);
+    if (newPosition)
+        *newPosition = pos;
+    return 0;
+}
+
+int Lib7ZipSpoolOutStream::SetSize(UInt64 newSize) {
+    DEBUGLOG("Lib7ZipSpoolOutStream::SetSize " << newSize);
+    return 0;
+}
+
+Lib7ZipInStream *Lib7ZipSpoolOutStream::Detach(Tcl_Obj *type) {
+    DEBUGLOG("Lib7ZipSpoolOutStream::Detach " << size);
+    if (tclChannel && (Tcl_Flush(tclChannel) != TCL_OK || Tcl_Seek(tclChannel, 0, SEEK_SET) < 0))
+        return NULL;
+    memory.resize(tclChannel ? 0 : size);
+    Lib7ZipInStream *stream = new Lib7ZipInStream(tclChannel, memory, size, type);
+    tclChannel = NULL;
+    return stream;
+}
+
+
+Lib7ZipMultiVolumes::Lib7ZipMultiVolumes(Tcl_Interp *interp, Tcl_Obj *path, Tcl_Obj *type, size_t limit):
+        tclInterp(interp), type(type), current(NULL), first(L""), volumes(), opened(), limit(limit > 0 ? limit : 1),
+        convert() {
+    DEBUGLOG("Lib7ZipMultiVolumes up to " << limit << " open");
     if (type)
         Tcl_IncrRefCount(type);
-    MoveToVolume(convert.from_bytes(Tcl_GetString(path)));
+    first = convert.from_bytes(Tcl_GetString(path));
+    MoveToVolume(first);
 }
 
 Lib7ZipMultiVolumes::~Lib7ZipMultiVolumes() {
     DEBUGLOG("~Lib7ZipMultiVolumes");
     if (type)
         Tcl_DecrRefCount(type);
-    for (std::vector<Lib7ZipInStream *>::iterator i = streams.begin(); i != streams.end(); i++)
-        delete *i;
+    for (std::unordered_map<std::wstring, Lib7ZipInStream *>::iterator i = volumes.begin(); i != volumes.end(); i++)
+        delete i->second;
 }
 
 std::wstring Lib7ZipMultiVolumes::GetFirstVolumeName() {
     DEBUGLOG("Lib7ZipMultiVolumes::GetFirstVolumeName");
-    return streams.size() ? streams[0]->GetName() : L"";
+    return volumes.count(first) ? first : L"";
 };
 
 bool Lib7ZipMultiVolumes::MoveToVolume(const wstring &volumeName) {
-    current = NULL;
-    for (std::vector<Lib7ZipInStream *>::iterator i = streams.begin(); i != streams.end(); i++) {
-        if ((*i)->GetName() == volumeName) {
-            DEBUGLOG("Lib7ZipMultiVolumes::MoveToVolume found " << *i);
-            current = *i;
-            break;
-        }
+    std::unordered_map<std::wstring, Lib7ZipInStream *>::iterator found = volumes.find(volumeName);
+    if (found != volumes.end()) {
+        DEBUGLOG("Lib7ZipMultiVolumes::MoveToVolume found " << found->second);
+        current = found->second;
+        return true;
     }
-    if (current == NULL) {
-        Tcl_Obj *filename = Tcl_NewStringObj(convert.to_bytes(volumeName).c_str(), -1);
-        Tcl_IncrRefCount(filename);
-        current = new Lib7ZipInStream(tclInterp, filename, type, false);
-        Tcl_DecrRefCount(filename);
-        streams.push_back(current);
-        DEBUGLOG("Lib7ZipMultiVolumes::MoveToVolume add " << current);
+    // NOTE: the handlers probe for the volume past the last one, the missing files are not kept
+    Reserve();
+    Tcl_Obj *filename = Tcl_NewStringObj(convert.to_bytes(volumeName).c_str(), -1);
+    Tcl_IncrRefCount(filename);
+    current = new Lib7ZipInStream(tclInterp, filename, type, false);
+    Tcl_DecrRefCount(filename);
+    if (!current->Valid()) {
+        delete current;
+        current = NULL;
+        return false;
     }
-    return current->Valid();
+    current->owner = this;
+    current->recent = opened.insert(opened.begin(), current);
+    volumes[volumeName] = current;
+    DEBUGLOG("Lib7ZipMultiVolumes::MoveToVolume add " << current << ", " << opened.size() << " open");
+    return true;
 }
 
 UInt64 Lib7ZipMultiVolumes::GetCurrentVolumeSize() {
-    Tcl_Panic("Lib7ZipMultiVolumes::GetCurrentVolumeSize!");
     UInt64 size;
-    if (!current)
-        return -1;
-    if (!current->GetSize(&size))
-        return -1;
+    if (!current || current->GetSize(&size) != 0)
+        return 0;
+    DEBUGLOG("Lib7ZipMultiVolumes::GetCurrentVolumeSize => " << size);
     return size;
 };
 
@@ -237,3 +1340,29 @@ C7ZipInStream *Lib7ZipMultiVolumes::OpenCurrentVolumeStream() {
     DEBUGLOG("Lib7ZipMultiVolumes::OpenCurrentVolumeStream " << current);
     return current && current->Valid() ? current : NULL;
 };
+
+// Marks the stream as the most recently used one, reopening its file if it was released.
+
+bool Lib7ZipMultiVolumes::Touch(Lib7ZipInStream *stream) {
+    if (stream->released) {
+        Reserve();
+        if (!stream->Reopen())
+            return false;
+        stream->recent = opened.insert(opened.begin(), stream);
+        DEBUGLOG("Lib7ZipMultiVolumes::Touch reopened " << stream << ", " << opened.size() << " open");
+    } else if (stream->recent != opened.begin()) {
+        opened.splice(opened.begin(), opened, stream->recent);
+    }
+    return true;
+}
+
+// Releases the least recently used files until there is room for one more.
+
+void Lib7ZipMultiVolumes::Reserve() {
+    while (opened.size() >= limit) {
+        Lib7ZipInStream *stream = opened.back();
+        opened.pop_back();
+        stream->Release();
+        DEBUGLOG("Lib7ZipMultiVolumes::Reserve released " << stream);
+    }
+}
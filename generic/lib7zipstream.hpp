@@ -4,14 +4,51 @@
 #include <locale>
 #include <codecvt>
 #include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <atomic>
 #include <lib7zip.h>
 #include <tcl.h>
 
+#include "lib7ziphash.hpp"
+
+// Cancellation request and time budget of a running operation. The streams check
+// it on every read and write and fail, so the decoder aborts at the next block.
+
+class Lib7ZipCancel {
+
+public:
+
+    enum {
+        CANCEL_NONE,
+        CANCEL_REQUESTED,
+        CANCEL_TIMEOUT
+    };
+
+    Lib7ZipCancel(): state(CANCEL_NONE), deadline(0), owner(Tcl_GetCurrentThread()) {};
+
+    void Start(Tcl_WideInt timeout);
+    void Cancel();
+    int Check();
+    Tcl_WideInt Remaining();
+    bool SetError(Tcl_Interp *interp);
+
+private:
+
+    std::atomic<int> state;
+    Tcl_WideInt deadline;
+    Tcl_ThreadId owner;
+};
+
+class Lib7ZipMultiVolumes;
+
 class Lib7ZipInStream:  public C7ZipInStream {
 
 public:
 
-    Lib7ZipInStream(Tcl_Interp *interp, Tcl_Obj *file, Tcl_Obj *type, bool usechannel);
+    Lib7ZipInStream(Tcl_Interp *interp, Tcl_Obj *file, Tcl_Obj *type, bool usechannel, Tcl_WideInt spool = -1);
+    Lib7ZipInStream(Tcl_Channel spool, std::vector<char> &data, UInt64 size, Tcl_Obj *type);
 
     virtual ~Lib7ZipInStream();
 
@@ -21,17 +58,41 @@ public:
     virtual int GetSize(UInt64 *size);
 
     std::wstring GetName() {return name;};
-    bool Valid() {return !!tclChannel;};
+    void SetExt(const std::wstring &type) {ext = type;};
+    void SetCancel(Lib7ZipCancel *c) {cancel = c;};
+    bool IsChannel() {return !closechannel || spooled;};
+    bool SetRange(UInt64 offset, UInt64 length);
+    bool IsRanged() {return ranged;};
+    UInt64 Base() {return base;};
+    int NativeHandle();
+    bool Valid() {return tclChannel || inmemory || released;};
 
 private:
 
+    friend class Lib7ZipMultiVolumes;
+
     Tcl_Interp *tclInterp;
     Tcl_Channel tclChannel;
     bool closechannel;
+    bool spooled;
+    bool inmemory;
+    std::vector<char> memory;
+    UInt64 mempos;
+    bool ranged;
+    UInt64 base;
     UInt64 end;
+    bool released;
+    Tcl_WideInt releasedpos;
+    Lib7ZipMultiVolumes *owner;
+    std::list<Lib7ZipInStream *>::iterator recent;
+    Lib7ZipCancel *cancel;
     std::wstring name;
     std::wstring ext;
     std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
+
+    bool Spool(Tcl_Obj *file, Tcl_WideInt threshold);
+    bool Release();
+    bool Reopen();
 };
 
 class Lib7ZipOutStream:  public C7ZipOutStream {
@@ -46,21 +107,202 @@ public:
     virtual int Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition);
     virtual int SetSize(UInt64 size);
 
-    bool Valid() {return !!tclChannel;};
+    void SetHash(Lib7ZipHash *h) {hash = h;};
+    void SetHighWater(Tcl_WideInt size) {highwater = size;};
+    void SetCancel(Lib7ZipCancel *c) {cancel = c;};
+    void SetSparse(bool s) {sparse = s;};
+    int SetMTime(UInt64 filetime);
+    int SetMode(int mode);
+    int CopyRange(int source, UInt64 offset, UInt64 size);
+    int CloneFile(Tcl_Obj *source);
+    int Finish();
+    int Close();
+    bool IsNative() {return fd >= 0;};
+    bool Valid() {return tclChannel || fd >= 0;};
 
 private:
 
     Tcl_Interp *tclInterp;
     Tcl_Channel tclChannel;
     bool closechannel;
+    int fd;
+    char *buffer;
+    size_t used;
+    bool sparse;
+    UInt64 hole;
+    Tcl_WideInt position;
+    Lib7ZipHash *hash;
+    Tcl_WideInt highwater;
+    Lib7ZipCancel *cancel;
     std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
+
+    int Flush();
+    int WriteNative(const char *data, size_t size);
+    int WaitWritable();
+    static bool Block_IsZero(const char *data, size_t size);
+    static void OutputReady(ClientData clientData, int mask);
+    static void TimeoutReady(ClientData clientData);
 };
 
+class Lib7ZipNullOutStream:  public C7ZipOutStream {
+
+public:
+
+    Lib7ZipNullOutStream();
+
+    virtual ~Lib7ZipNullOutStream();
+
+    virtual int Write(const void *data, unsigned int size, unsigned int *processedSize);
+    virtual int Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition);
+    virtual int SetSize(UInt64 size);
+
+    UInt64 Size() {return size;};
+    void SetCancel(Lib7ZipCancel *c) {cancel = c;};
+    void SetHash(Lib7ZipHash *h) {hash = h;};
+
+private:
+
+    UInt64 pos;
+    UInt64 size;
+    Lib7ZipCancel *cancel;
+    Lib7ZipHash *hash;
+};
+
+class Lib7ZipDataInStream:  public C7ZipInStream {
+
+public:
+
+    Lib7ZipDataInStream(Tcl_Obj *data, Tcl_Obj *type);
+
+    virtual ~Lib7ZipDataInStream();
+
+    virtual std::wstring GetExt() const {return ext;};
+    virtual int Read(void *data, unsigned int size, unsigned int *processedSize);
+    virtual int Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition);
+    virtual int GetSize(UInt64 *size);
+
+    void SetExt(const std::wstring &type) {ext = type;};
+
+private:
+
+    Tcl_Obj *data;
+    UInt64 pos;
+    std::wstring ext;
+    std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
+};
+
+// Input read by a script command in aligned blocks, for the sources with expensive range reads.
+// The blocks are kept in a LRU cache, the sequential misses fetch a growing read-ahead at once.
+
+class Lib7ZipReaderInStream:  public C7ZipInStream {
+
+public:
+
+    Lib7ZipReaderInStream(Tcl_Interp *interp, Tcl_Obj *command, UInt64 size, Tcl_Obj *type, size_t blocksize);
+
+    virtual ~Lib7ZipReaderInStream();
+
+    virtual std::wstring GetExt() const {return ext;};
+    virtual int Read(void *data, unsigned int size, unsigned int *processedSize);
+    virtual int Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition);
+    virtual int GetSize(UInt64 *size);
+
+    void SetExt(const std::wstring &type) {ext = type;};
+    void SetCancel(Lib7ZipCancel *c) {cancel = c;};
+    Tcl_Obj *GetError() {return error;};
+
+private:
+
+    typedef struct {
+        UInt64 block;
+        Tcl_Obj *data;
+        size_t offset;
+        size_t length;
+    } Lib7ZipReaderBlock;
+
+    Tcl_Interp *tclInterp;
+    Tcl_Obj *command;
+    Tcl_Obj *error;
+    UInt64 pos;
+    UInt64 size;
+    size_t blocksize;
+    UInt64 next;
+    UInt64 readahead;
+    std::list<Lib7ZipReaderBlock> blocks;
+    std::map<UInt64, std::list<Lib7ZipReaderBlock>::iterator> cached;
+    Lib7ZipCancel *cancel;
+    std::wstring ext;
+    std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
+
+    const Lib7ZipReaderBlock *Block(UInt64 block);
+    bool Fetch(UInt64 block, UInt64 count);
+};
+
+class Lib7ZipDataOutStream:  public C7ZipOutStream {
+
+public:
+
+    Lib7ZipDataOutStream(UInt64 limit = ~(UInt64)0);
+
+    virtual ~Lib7ZipDataOutStream();
+
+    virtual int Write(const void *data, unsigned int size, unsigned int *processedSize);
+    virtual int Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition);
+    virtual int SetSize(UInt64 size);
+
+    Tcl_Obj *GetData();
+    bool Truncated() {return truncated;};
+    void SetCancel(Lib7ZipCancel *c) {cancel = c;};
+
+private:
+
+    Tcl_Obj *data;
+    UInt64 pos;
+    UInt64 size;
+    UInt64 allocated;
+    UInt64 limit;
+    bool truncated;
+    Lib7ZipCancel *cancel;
+
+    bool Reserve(UInt64 size);
+};
+
+// Output kept in memory up to the threshold and moved to an anonymous temporary file past it,
+// the data written is read back by the input stream it is detached to.
+
+class Lib7ZipSpoolOutStream:  public C7ZipOutStream {
+
+public:
+
+    Lib7ZipSpoolOutStream(UInt64 threshold);
+
+    virtual ~Lib7ZipSpoolOutStream();
+
+    virtual int Write(const void *data, unsigned int size, unsigned int *processedSize);
+    virtual int Seek(__int64 offset, unsigned int seekOrigin, UInt64 *newPosition);
+    virtual int SetSize(UInt64 size);
+
+    Lib7ZipInStream *Detach(Tcl_Obj *type);
+    void SetCancel(Lib7ZipCancel *c) {cancel = c;};
+
+private:
+
+    Tcl_Channel tclChannel;
+    std::vector<char> memory;
+    UInt64 threshold;
+    UInt64 pos;
+    UInt64 size;
+    Lib7ZipCancel *cancel;
+};
+
+// Volumes of a multi-volume archive by name, with their sizes. The volume streams live as long as
+// the archive, but only the most recently used ones keep their files open, up to the limit.
+
 class Lib7ZipMultiVolumes:  public C7ZipMultiVolumes {
 
 public:
 
-    Lib7ZipMultiVolumes(Tcl_Interp *interp, Tcl_Obj *path, Tcl_Obj *type);
+    Lib7ZipMultiVolumes(Tcl_Interp *interp, Tcl_Obj *path, Tcl_Obj *type, size_t limit = 64);
 
     virtual ~Lib7ZipMultiVolumes();
 
@@ -70,14 +312,20 @@ public:
     virtual C7ZipInStream *OpenCurrentVolumeStream();
 
     bool Valid() {return current && current->Valid();};
+    bool Touch(Lib7ZipInStream *stream);
 
 private:
 
     Tcl_Interp *tclInterp;
     Tcl_Obj *type;
     Lib7ZipInStream *current;
-    std::vector<Lib7ZipInStream *> streams;
+    std::wstring first;
+    std::unordered_map<std::wstring, Lib7ZipInStream *> volumes;
+    std::list<Lib7ZipInStream *> opened;
+    size_t limit;
     std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
+
+    void Reserve();
 };
 
 #endif
\ No newline at end of file
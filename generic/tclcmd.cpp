@@ -95,7 +95,17 @@ int TclCmd::Dispatch (ClientData clientData, Tcl_Interp * interp,
 	     Tcl_GetString(objv[0]) << " " << (objc > 1 ? Tcl_GetString(objv[1]) : "") << "'");
   }
 #endif
-  return o->Command(objc, objv);
+  // NOTE: a command serving the event loop may see itself or its parent
+  // deleted by a nested script, keep the whole chain alive until it returns
+  TclCmd *p, *next;
+  for (p = o; p; p = p->pParent)
+    Tcl_Preserve(p);
+  int result = o->Command(objc, objv);
+  for (p = o; p; p = next) {
+    next = p->pParent;
+    Tcl_Release(p);
+  }
+  return result;
 }
 
 void TclCmd::Destroy(ClientData clientData) {
@@ -105,6 +115,14 @@ void TclCmd::Destroy(ClientData clientData) {
   if (o->IsNamed()) {
     o->Cleanup();
     o->Unname();
-    delete o;
+    Tcl_EventuallyFree(o, (Tcl_FreeProc *) TclCmd::Free);
   }
 }
+
+void TclCmd::Free(ClientData clientData) {
+  TclCmd *o = (TclCmd *) clientData;
+
+  DEBUGLOG("TclCmd::Free *" << o);
+  o->Cleanup();
+  delete o;
+}
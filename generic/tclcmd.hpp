@@ -45,7 +45,8 @@ public:
   void SetParent(TclCmd * parent);
 
   static void Destroy(ClientData);
-  // static function for destroying objects
+  static void Free(ClientData);
+  // static functions for destroying objects, deferred while dispatching
   
   static int Dispatch(ClientData clientData, Tcl_Interp * interp,
 		      int objc, Tcl_Obj * const objv[]);